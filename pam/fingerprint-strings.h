@@ -25,6 +25,7 @@
 #endif
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 
 #define GNUC_UNUSED __attribute__((__unused__))
 
@@ -38,6 +39,50 @@ str_equal (const char *a, const char *b)
   return strcmp (a, b) == 0;
 }
 
+/* In the order of fingers[] */
+typedef enum
+{
+  FINGER_ANY,
+  FINGER_LEFT_THUMB,
+  FINGER_LEFT_INDEX,
+  FINGER_LEFT_MIDDLE,
+  FINGER_LEFT_RING,
+  FINGER_LEFT_LITTLE,
+  FINGER_RIGHT_THUMB,
+  FINGER_RIGHT_INDEX,
+  FINGER_RIGHT_MIDDLE,
+  FINGER_RIGHT_RING,
+  FINGER_RIGHT_LITTLE,
+  FINGER_UNKNOWN,
+} Finger;
+
+typedef enum
+{
+  VERIFY_RESULT_NONE,
+  VERIFY_RESULT_NO_MATCH,
+  VERIFY_RESULT_MATCH,
+  VERIFY_RESULT_RETRY_SCAN,
+  VERIFY_RESULT_SWIPE_TOO_SHORT,
+  VERIFY_RESULT_FINGER_NOT_CENTERED,
+  VERIFY_RESULT_REMOVE_AND_RETRY,
+  VERIFY_RESULT_DISCONNECTED,
+  VERIFY_RESULT_UNKNOWN_ERROR,
+  VERIFY_RESULT_PROTOCOL_ERROR, /* Anything else fprintd sent us */
+} VerifyResult;
+
+static const char * const verify_result_names[] = {
+  [VERIFY_RESULT_NONE] = NULL,
+  [VERIFY_RESULT_NO_MATCH] = "verify-no-match",
+  [VERIFY_RESULT_MATCH] = "verify-match",
+  [VERIFY_RESULT_RETRY_SCAN] = "verify-retry-scan",
+  [VERIFY_RESULT_SWIPE_TOO_SHORT] = "verify-swipe-too-short",
+  [VERIFY_RESULT_FINGER_NOT_CENTERED] = "verify-finger-not-centered",
+  [VERIFY_RESULT_REMOVE_AND_RETRY] = "verify-remove-and-retry",
+  [VERIFY_RESULT_DISCONNECTED] = "verify-disconnected",
+  [VERIFY_RESULT_UNKNOWN_ERROR] = "verify-unknown-error",
+  [VERIFY_RESULT_PROTOCOL_ERROR] = "protocol-error",
+};
+
 struct
 {
   const char *dbus_name;
@@ -104,82 +149,169 @@ struct
   { NULL, NULL, NULL, NULL, NULL }
 };
 
+/* Perfect hashes of the names above, so that a lookup costs one hash
+ * and one comparison. The verify results all differ in length, the
+ * fingers need their first and ninth character as well. Slots hold the
+ * value plus one, zero marks an empty slot. If a name is added, pick
+ * new hashes without collisions. */
+#define FINGER_HASH_SIZE 32
+#define VERIFY_RESULT_HASH_SIZE 16
+
+static const unsigned char finger_slots[FINGER_HASH_SIZE] = {
+  [10] = FINGER_ANY + 1,
+  [23] = FINGER_LEFT_THUMB + 1,
+  [4] = FINGER_LEFT_INDEX + 1,
+  [6] = FINGER_LEFT_MIDDLE + 1,
+  [3] = FINGER_LEFT_RING + 1,
+  [22] = FINGER_LEFT_LITTLE + 1,
+  [8] = FINGER_RIGHT_THUMB + 1,
+  [12] = FINGER_RIGHT_INDEX + 1,
+  [15] = FINGER_RIGHT_MIDDLE + 1,
+  [19] = FINGER_RIGHT_RING + 1,
+  [31] = FINGER_RIGHT_LITTLE + 1,
+};
+
+static const unsigned char verify_result_slots[VERIFY_RESULT_HASH_SIZE] = {
+  [15] = VERIFY_RESULT_NO_MATCH + 1,
+  [12] = VERIFY_RESULT_MATCH + 1,
+  [1] = VERIFY_RESULT_RETRY_SCAN + 1,
+  [6] = VERIFY_RESULT_SWIPE_TOO_SHORT + 1,
+  [10] = VERIFY_RESULT_FINGER_NOT_CENTERED + 1,
+  [7] = VERIFY_RESULT_REMOVE_AND_RETRY + 1,
+  [3] = VERIFY_RESULT_DISCONNECTED + 1,
+  [4] = VERIFY_RESULT_UNKNOWN_ERROR + 1,
+};
+
+GNUC_UNUSED static Finger
+finger_from_str (const char *finger_name)
+{
+  size_t len;
+  unsigned slot;
+
+  if (finger_name == NULL)
+    return FINGER_UNKNOWN;
+
+  len = strlen (finger_name);
+  slot = finger_slots[(3 * len + (unsigned char) finger_name[0] +
+                       (len > 8 ? (unsigned char) finger_name[8] : 0)) % FINGER_HASH_SIZE];
+  if (slot == 0 || !str_equal (fingers[slot - 1].dbus_name, finger_name))
+    return FINGER_UNKNOWN;
+
+  return slot - 1;
+}
+
+GNUC_UNUSED static VerifyResult
+verify_result_from_str (const char *result)
+{
+  unsigned slot;
+
+  if (result == NULL)
+    return VERIFY_RESULT_PROTOCOL_ERROR;
+
+  slot = verify_result_slots[strlen (result) % VERIFY_RESULT_HASH_SIZE];
+  if (slot == 0 || !str_equal (verify_result_names[slot - 1], result))
+    return VERIFY_RESULT_PROTOCOL_ERROR;
+
+  return slot - 1;
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-nonliteral"
 
+GNUC_UNUSED static const char *
+finger_msg_format (Finger finger, const char *driver_name, bool is_swipe)
+{
+  if (is_swipe == false)
+    return driver_name ? fingers[finger].place_str_specific : fingers[finger].place_str_generic;
+  else
+    return driver_name ? fingers[finger].swipe_str_specific : fingers[finger].swipe_str_generic;
+}
+
 GNUC_UNUSED static char *
-finger_str_to_msg (const char *finger_name, const char *driver_name, bool is_swipe)
+finger_to_msg (Finger finger, const char *driver_name, bool is_swipe)
 {
-  int i;
+  const char *format;
+  char *s;
 
-  if (finger_name == NULL)
+  if (finger == FINGER_UNKNOWN)
     return NULL;
 
-  for (i = 0; fingers[i].dbus_name != NULL; i++)
-    {
-      if (!str_equal (fingers[i].dbus_name, finger_name))
-        continue;
-      if (is_swipe == false)
-        {
-          if (driver_name)
-            {
-              char *s;
-              int ret;
-              ret = asprintf (&s, TR (fingers[i].place_str_specific), driver_name);
-              return ret >= 0 ? s : NULL;
-            }
-          else
-            {
-              return strdup (TR (fingers[i].place_str_generic));
-            }
-        }
-      else
-        {
-          if (driver_name)
-            {
-              char *s;
-              int ret;
-              ret = asprintf (&s, TR (fingers[i].swipe_str_specific), driver_name);
-              return ret >= 0 ? s : NULL;
-            }
-          else
-            {
-              return strdup (TR (fingers[i].swipe_str_generic));
-            }
-        }
-    }
+  format = finger_msg_format (finger, driver_name, is_swipe);
+  if (!driver_name)
+    return strdup (TR (format));
 
-  return NULL;
+  return asprintf (&s, TR (format), driver_name) >= 0 ? s : NULL;
+}
+
+/* Same as finger_to_msg(), into a caller-provided buffer. Returns false
+ * if the message did not fit. */
+GNUC_UNUSED static bool
+finger_format_msg (Finger finger, const char *driver_name, bool is_swipe, char *buf, size_t len)
+{
+  int r;
+
+  if (finger == FINGER_UNKNOWN)
+    return false;
+
+  r = snprintf (buf, len, TR (finger_msg_format (finger, driver_name, is_swipe)), driver_name);
+  return r >= 0 && (size_t) r < len;
 }
 
 #pragma GCC diagnostic pop
 
+GNUC_UNUSED static char *
+finger_str_to_msg (const char *finger_name, const char *driver_name, bool is_swipe)
+{
+  return finger_to_msg (finger_from_str (finger_name), driver_name, is_swipe);
+}
+
+/* Whether a result that is not done asks for another scan, without
+ * translating anything */
+GNUC_UNUSED static bool
+verify_result_is_retry (VerifyResult result)
+{
+  switch (result)
+    {
+    case VERIFY_RESULT_RETRY_SCAN:
+    case VERIFY_RESULT_SWIPE_TOO_SHORT:
+    case VERIFY_RESULT_FINGER_NOT_CENTERED:
+    case VERIFY_RESULT_REMOVE_AND_RETRY:
+      return true;
+    default:
+      return false;
+    }
+}
+
 /* Cases not handled:
  * verify-no-match
  * verify-match
  * verify-unknown-error
  */
 GNUC_UNUSED static const char *
-verify_result_str_to_msg (const char *result, bool is_swipe)
+verify_result_to_msg (VerifyResult result, bool is_swipe)
 {
-  if (result == NULL)
-    return NULL;
-
-  if (strcmp (result, "verify-retry-scan") == 0)
+  switch (result)
     {
+    case VERIFY_RESULT_RETRY_SCAN:
       if (is_swipe == false)
         return TR (N_("Place your finger on the reader again"));
       else
         return TR (N_("Swipe your finger again"));
+    case VERIFY_RESULT_SWIPE_TOO_SHORT:
+      return TR (N_("Swipe was too short, try again"));
+    case VERIFY_RESULT_FINGER_NOT_CENTERED:
+      return TR (N_("Your finger was not centered, try swiping your finger again"));
+    case VERIFY_RESULT_REMOVE_AND_RETRY:
+      return TR (N_("Remove your finger, and try swiping your finger again"));
+    default:
+      return NULL;
     }
-  if (strcmp (result, "verify-swipe-too-short") == 0)
-    return TR (N_("Swipe was too short, try again"));
-  if (strcmp (result, "verify-finger-not-centered") == 0)
-    return TR (N_("Your finger was not centered, try swiping your finger again"));
-  if (strcmp (result, "verify-remove-and-retry") == 0)
-    return TR (N_("Remove your finger, and try swiping your finger again"));
+}
 
-  return NULL;
+GNUC_UNUSED static const char *
+verify_result_str_to_msg (const char *result, bool is_swipe)
+{
+  return verify_result_to_msg (verify_result_from_str (result), is_swipe);
 }
 
 /* Cases not handled:
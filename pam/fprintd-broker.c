@@ -0,0 +1,517 @@
+/*
+ * fprintd-grosshack-broker: per-session cache of the fprintd device view
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The broker is started through socket activation in the user session.
+ * It keeps a warm system bus connection and remembers which fprintd
+ * device has the most prints enrolled for the session user, so that
+ * pam_fprintd_grosshack can skip GetDevices and ListEnrolledFingers.
+ *
+ * Claiming is left to the module: fprintd ties a claim to the bus
+ * connection of the claimer, so it cannot be handed over. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <systemd/sd-bus.h>
+#include <systemd/sd-daemon.h>
+#include <systemd/sd-event.h>
+
+#include "fprintd-broker.h"
+#include "pam_fprintd_autoptrs.h"
+
+#define USEC_PER_SEC ((uint64_t)1000000ULL)
+#define NSEC_PER_USEC ((uint64_t)1000ULL)
+
+/* How often the device view is refreshed in the background, as fprintd
+ * does not announce deleted prints. Enrollments and fprintd restarts
+ * refresh it right away. */
+#define CACHE_TTL_SEC 600
+/* When fprintd could not be asked at all */
+#define CACHE_RETRY_SEC 30
+/* Exit after this long without clients, systemd restarts us on demand */
+#define IDLE_TIMEOUT_SEC 300
+#define CLIENT_TIMEOUT_SEC 1
+
+PF_DEFINE_AUTOPTR_CLEANUP_FUNC(sd_event, sd_event_unref)
+PF_DEFINE_AUTOPTR_CLEANUP_FUNC(sd_event_source, sd_event_source_unref)
+
+typedef struct broker broker;
+
+/* One ListEnrolledFingers call of a refresh */
+typedef struct
+{
+  broker *b;
+  sd_bus_slot *slot;
+  char *path;
+  size_t enrolled_prints;
+} refresh_call;
+
+struct broker
+{
+  sd_bus *bus;
+  sd_event *event;
+  sd_event_source *idle_source;
+  sd_event_source *refresh_source;
+  const char *username;
+
+  bool valid;
+  size_t num_devices;
+  size_t max_prints;
+  char *path;
+
+  /* The refresh in progress, if any */
+  bool refreshing;
+  sd_bus_slot *devices_slot;
+  refresh_call *calls;
+  size_t num_calls;
+  size_t pending;
+};
+
+static uint64_t
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * USEC_PER_SEC + (uint64_t)ts.tv_nsec / NSEC_PER_USEC;
+}
+
+static void
+broker_invalidate(broker *b)
+{
+  b->valid = false;
+  free(b->path);
+  b->path = NULL;
+}
+
+static void
+broker_refresh_cancel(broker *b)
+{
+  size_t i;
+
+  b->devices_slot = sd_bus_slot_unref(b->devices_slot);
+  for (i = 0; i < b->num_calls; i++)
+  {
+    sd_bus_slot_unref(b->calls[i].slot);
+    free(b->calls[i].path);
+  }
+  free(b->calls);
+  b->calls = NULL;
+  b->num_calls = 0;
+  b->pending = 0;
+  b->refreshing = false;
+}
+
+static void
+broker_schedule_refresh(broker *b, uint64_t delay_sec)
+{
+  sd_event_source_set_time(b->refresh_source, now() + delay_sec * USEC_PER_SEC);
+  sd_event_source_set_enabled(b->refresh_source, SD_EVENT_ONESHOT);
+}
+
+/* Publishes the view once every reader answered */
+static void
+broker_refresh_done(broker *b)
+{
+  char *path = NULL;
+  size_t max_prints = 0;
+  size_t i;
+
+  for (i = 0; i < b->num_calls; i++)
+  {
+    if (b->calls[i].enrolled_prints > max_prints)
+    {
+      path = b->calls[i].path;
+      max_prints = b->calls[i].enrolled_prints;
+    }
+  }
+
+  broker_invalidate(b);
+  if (path)
+  {
+    b->path = strdup(path);
+    if (!b->path)
+    {
+      broker_refresh_cancel(b);
+      broker_schedule_refresh(b, CACHE_RETRY_SEC);
+      return;
+    }
+  }
+  b->num_devices = b->num_calls;
+  b->max_prints = max_prints;
+  b->valid = true;
+
+  broker_refresh_cancel(b);
+  broker_schedule_refresh(b, CACHE_TTL_SEC);
+}
+
+static int
+list_enrolled_fingers_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+  refresh_call *call = userdata;
+  broker *b = call->b;
+  const char *s;
+
+  /* Readers that fail count as having no prints, as before */
+  if (!sd_bus_message_is_method_error(m, NULL) &&
+      sd_bus_message_enter_container(m, 'a', "s") >= 0)
+  {
+    while (sd_bus_message_read_basic(m, 's', &s) > 0)
+      call->enrolled_prints++;
+    sd_bus_message_exit_container(m);
+  }
+
+  if (--b->pending == 0)
+    broker_refresh_done(b);
+
+  return 0;
+}
+
+static int
+get_devices_cb(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+  broker *b = userdata;
+  size_t num_devices = 0;
+  size_t i;
+  const char *s;
+  int r;
+
+  if (sd_bus_message_is_method_error(m, NULL))
+  {
+    syslog(LOG_ERR, "GetDevices failed: %s", sd_bus_message_get_error(m)->message);
+    goto fail;
+  }
+
+  r = sd_bus_message_enter_container(m, 'a', "o");
+  if (r < 0)
+    goto fail;
+  while (sd_bus_message_read_basic(m, 'o', &s) > 0)
+    num_devices++;
+  if (sd_bus_message_rewind(m, false) < 0)
+    goto fail;
+
+  b->calls = calloc(num_devices ? num_devices : 1, sizeof(refresh_call));
+  if (!b->calls)
+    goto fail;
+
+  /* Ask all readers at once, a refresh costs a single round-trip */
+  for (i = 0; i < num_devices && sd_bus_message_read_basic(m, 'o', &s) > 0; i++)
+  {
+    refresh_call *call = &b->calls[b->num_calls];
+
+    call->b = b;
+    call->path = strdup(s);
+    if (!call->path)
+      goto fail;
+    b->num_calls++;
+
+    if (sd_bus_call_method_async(b->bus,
+                                 &call->slot,
+                                 "net.reactivated.Fprint",
+                                 call->path,
+                                 "net.reactivated.Fprint.Device",
+                                 "ListEnrolledFingers",
+                                 list_enrolled_fingers_cb,
+                                 call,
+                                 "s",
+                                 b->username) >= 0)
+      b->pending++;
+  }
+  sd_bus_message_exit_container(m);
+
+  if (b->pending == 0)
+    broker_refresh_done(b);
+
+  return 0;
+
+fail:
+  broker_refresh_cancel(b);
+  broker_schedule_refresh(b, CACHE_RETRY_SEC);
+  return 0;
+}
+
+/* Starts over if a refresh is already in progress, its answers may
+ * predate what made us refresh. The current view is kept meanwhile. */
+static int
+broker_refresh(broker *b)
+{
+  int r;
+
+  broker_refresh_cancel(b);
+
+  r = sd_bus_call_method_async(b->bus,
+                               &b->devices_slot,
+                               "net.reactivated.Fprint",
+                               "/net/reactivated/Fprint/Manager",
+                               "net.reactivated.Fprint.Manager",
+                               "GetDevices",
+                               get_devices_cb,
+                               b,
+                               NULL);
+  if (r < 0)
+  {
+    syslog(LOG_ERR, "GetDevices call failed: %d", r);
+    broker_schedule_refresh(b, CACHE_RETRY_SEC);
+    return r;
+  }
+  b->refreshing = true;
+
+  return 0;
+}
+
+static int
+refresh_timeout(sd_event_source *s, uint64_t usec, void *userdata)
+{
+  broker *b = userdata;
+
+  broker_refresh(b);
+  return 0;
+}
+
+static int
+name_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+  broker *b = userdata;
+  const char *name = NULL;
+  const char *old_owner = NULL;
+  const char *new_owner = NULL;
+
+  if (sd_bus_message_read(m, "sss", &name, &old_owner, &new_owner) < 0)
+    return 0;
+
+  /* fprintd exits when idle, which changes nothing. Asking it then
+   * would only start it again, so wait until it is back. */
+  if (strcmp(name, "net.reactivated.Fprint") == 0 && new_owner[0] != '\0')
+    broker_refresh(b);
+
+  return 0;
+}
+
+static int
+enroll_status(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+  broker *b = userdata;
+  const char *result = NULL;
+  int done = false;
+
+  if (sd_bus_message_read(m, "sb", &result, &done) < 0)
+    return 0;
+
+  if (done)
+  {
+    broker_invalidate(b);
+    broker_refresh(b);
+  }
+
+  return 0;
+}
+
+/* Never waits for fprintd, the module only gives us BROKER_TIMEOUT_MS.
+ * Without a view it does the discovery itself, and we get one ready for
+ * the next client. */
+static void
+format_reply(broker *b, char *buf, size_t len)
+{
+  if (!b->valid)
+  {
+    if (!b->refreshing)
+      broker_refresh(b);
+    snprintf(buf, len, "%s\n", BROKER_REPLY_ERR);
+    return;
+  }
+
+  if (b->path)
+    snprintf(buf, len, "%s %zu %zu %s\n", BROKER_REPLY_OK,
+             b->num_devices, b->max_prints, b->path);
+  else
+    snprintf(buf, len, "%s %zu\n", BROKER_REPLY_NONE, b->num_devices);
+}
+
+static void
+handle_client(broker *b, int fd)
+{
+  const struct timeval tv = {.tv_sec = CLIENT_TIMEOUT_SEC};
+  char request[BROKER_MAX_LINE];
+  char reply[BROKER_MAX_LINE];
+  const char *username;
+  size_t len = 0;
+  char *nl = NULL;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  while (len < sizeof(request) - 1 && !nl)
+  {
+    ssize_t n = read(fd, request + len, sizeof(request) - 1 - len);
+
+    if (n <= 0)
+      return;
+    len += n;
+    request[len] = '\0';
+    nl = strchr(request, '\n');
+  }
+  if (!nl)
+    return;
+  *nl = '\0';
+
+  if (strncmp(request, BROKER_REQUEST_LOOKUP " ", strlen(BROKER_REQUEST_LOOKUP) + 1) != 0)
+    return;
+  username = request + strlen(BROKER_REQUEST_LOOKUP) + 1;
+
+  /* We only ever ask fprintd on behalf of the session user */
+  if (strcmp(username, b->username) != 0)
+    snprintf(reply, sizeof(reply), "%s\n", BROKER_REPLY_ERR);
+  else
+    format_reply(b, reply, sizeof(reply));
+
+  if (write(fd, reply, strlen(reply)) < 0)
+    syslog(LOG_WARNING, "Failed to answer client: %m");
+}
+
+static int
+idle_timeout(sd_event_source *s, uint64_t usec, void *userdata)
+{
+  broker *b = userdata;
+
+  return sd_event_exit(b->event, 0);
+}
+
+static int
+client_ready(sd_event_source *s, int fd, uint32_t revents, void *userdata)
+{
+  broker *b = userdata;
+  int client_fd;
+
+  client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+  if (client_fd < 0)
+    return 0;
+
+  handle_client(b, client_fd);
+  close(client_fd);
+
+  sd_event_source_set_time(b->idle_source, now() + IDLE_TIMEOUT_SEC * USEC_PER_SEC);
+  sd_event_source_set_enabled(b->idle_source, SD_EVENT_ONESHOT);
+
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  pf_autoptr(sd_event) event = NULL;
+  pf_autoptr(sd_event_source) listen_source = NULL;
+  pf_autoptr(sd_event_source) idle_source = NULL;
+  pf_autoptr(sd_event_source) refresh_source = NULL;
+  pf_autoptr(sd_bus_slot) name_owner_changed_slot = NULL;
+  pf_autoptr(sd_bus_slot) enroll_status_slot = NULL;
+  pf_autoptr(sd_bus) bus = NULL;
+  broker b = {0};
+  struct passwd *pw;
+  int r;
+
+  openlog("fprintd-grosshack-broker", LOG_PID, LOG_AUTHPRIV);
+
+  if (sd_listen_fds(true) != 1)
+  {
+    syslog(LOG_ERR, "Expected exactly one socket from systemd");
+    return EXIT_FAILURE;
+  }
+
+  pw = getpwuid(getuid());
+  if (!pw)
+  {
+    syslog(LOG_ERR, "Failed to look up the session user");
+    return EXIT_FAILURE;
+  }
+  b.username = pw->pw_name;
+
+  if ((r = sd_event_default(&event)) < 0 ||
+      (r = sd_bus_open_system(&bus)) < 0 ||
+      (r = sd_bus_attach_event(bus, event, 0)) < 0)
+  {
+    syslog(LOG_ERR, "Failed to set up the event loop: %d", r);
+    return EXIT_FAILURE;
+  }
+  b.bus = bus;
+  b.event = event;
+
+  sd_bus_match_signal(bus,
+                      &name_owner_changed_slot,
+                      "org.freedesktop.DBus",
+                      "/org/freedesktop/DBus",
+                      "org.freedesktop.DBus",
+                      "NameOwnerChanged",
+                      name_owner_changed,
+                      &b);
+  sd_bus_match_signal(bus,
+                      &enroll_status_slot,
+                      "net.reactivated.Fprint",
+                      NULL,
+                      "net.reactivated.Fprint.Device",
+                      "EnrollStatus",
+                      enroll_status,
+                      &b);
+
+  r = sd_event_add_io(event, &listen_source, SD_LISTEN_FDS_START, EPOLLIN, client_ready, &b);
+  if (r < 0)
+  {
+    syslog(LOG_ERR, "Failed to watch the listening socket: %d", r);
+    return EXIT_FAILURE;
+  }
+
+  r = sd_event_add_time(event, &idle_source, CLOCK_MONOTONIC,
+                        now() + IDLE_TIMEOUT_SEC * USEC_PER_SEC, 0,
+                        idle_timeout, &b);
+  if (r < 0)
+  {
+    syslog(LOG_ERR, "Failed to add the idle timer: %d", r);
+    return EXIT_FAILURE;
+  }
+  b.idle_source = idle_source;
+
+  r = sd_event_add_time(event, &refresh_source, CLOCK_MONOTONIC, 0, 0,
+                        refresh_timeout, &b);
+  if (r < 0)
+  {
+    syslog(LOG_ERR, "Failed to add the refresh timer: %d", r);
+    return EXIT_FAILURE;
+  }
+  sd_event_source_set_enabled(refresh_source, SD_EVENT_OFF);
+  b.refresh_source = refresh_source;
+
+  /* Warm the cache right away, the first client is usually on its way */
+  broker_refresh(&b);
+
+  r = sd_event_loop(event);
+  broker_refresh_cancel(&b);
+  broker_invalidate(&b);
+
+  return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,43 @@
+/*
+ * Protocol shared by pam_fprintd_grosshack and its session broker
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+/* The broker listens on a stream socket in the user runtime directory,
+ * i.e. /run/user/<uid>/BROKER_SOCKET_NAME.
+ *
+ * Each connection carries exactly one exchange of newline-terminated
+ * lines:
+ *
+ *   -> "LOOKUP <username>"
+ *   <- "OK <num-devices> <enrolled-prints> <device-path>"
+ *   <- "NONE <num-devices>"      (no device has prints for the user)
+ *   <- "ERR"                     (the broker could not answer, or has
+ *                                 no device view yet)
+ */
+
+#define BROKER_SOCKET_NAME "fprintd-grosshack-broker.sock"
+#define BROKER_RUNTIME_DIR "/run/user"
+
+#define BROKER_REQUEST_LOOKUP "LOOKUP"
+#define BROKER_REPLY_OK "OK"
+#define BROKER_REPLY_NONE "NONE"
+#define BROKER_REPLY_ERR "ERR"
+
+#define BROKER_MAX_LINE 512
+#define BROKER_DEVICE_PREFIX "/net/reactivated/Fprint/Device/"
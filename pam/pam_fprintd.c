@@ -22,7 +22,11 @@
 #include <security/_pam_types.h>
 
 #define _GNU_SOURCE
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -36,26 +40,88 @@
 
 #include <libintl.h>
 #include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+#include <systemd/sd-journal.h>
 #include <systemd/sd-login.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <poll.h>
+#include <pwd.h>
 #include <termios.h>
 
 #define PAM_SM_AUTH
 #include <security/pam_modules.h>
 #include <security/pam_ext.h>
 
-#define _(s) ((char *)dgettext(GETTEXT_PACKAGE, s))
-#define TR(s) dgettext(GETTEXT_PACKAGE, s)
+/* The text domain is only bound once something actually gets
+ * translated, remote logins and "suppress-messages" never get there. */
+static pthread_once_t textdomain_once = PTHREAD_ONCE_INIT;
+
+static void
+textdomain_init(void)
+{
+  bindtextdomain(GETTEXT_PACKAGE, LOCALEDIR);
+  bind_textdomain_codeset(GETTEXT_PACKAGE, "UTF-8");
+}
+
+static const char *
+translate(const char *s)
+{
+  pthread_once(&textdomain_once, textdomain_init);
+  return dgettext(GETTEXT_PACKAGE, s);
+}
+
+#define _(s) ((char *)translate(s))
+#define TR(s) translate(s)
 #define N_(s) (s)
 
 #include "fingerprint-strings.h"
+#include "fprintd-broker.h"
+#include "pam_fprintd_arena.h"
 #include "pam_fprintd_autoptrs.h"
+#include "pam_fprintd_metrics.h"
+#include "pam_fprintd_secret.h"
+#include "pam_fprintd_state.h"
 
 #define DEFAULT_MAX_TRIES 3
 #define DEFAULT_TIMEOUT 30
 #define MIN_TIMEOUT 10
+/* Well below where a deadline in usec would wrap around */
+#define MAX_TIMEOUT_MS (UINT64_C(24) * 3600 * 1000)
+#define DISCOVERY_TIMEOUT_MS 2000
+#define BROKER_TIMEOUT_MS 250
+#define PROMPT_ARM_TIMEOUT_MS 100
+#define DEFAULT_KEY_DEBOUNCE_MS 50
+#define RELEASE_FLUSH_TIMEOUT_MS 200
+#define MAX_KEY_DEBOUNCE_MS 1000
+#define ENROLL_CACHE_DIR "enrolled"
+#define ENROLL_CACHE_MAX 1024
+#define MAX_READERS 4
+#define DEFAULT_REAUTH_IDLE 300
+/* How long the application gets to end its prompt on the abort fd */
+#define PROMPT_ABORT_GRACE_MS 500
+#define HEALTH_DIR "health"
+/* A reader that failed n times in a row sits out for 5s * 2^(n-1) */
+#define HEALTH_BACKOFF_BASE_SEC 5
+#define HEALTH_BACKOFF_MAX_SEC 600
+/* The record of a reader that did not fail for that long is dropped */
+#define HEALTH_RECORD_TTL_SEC (24 * 3600)
+/* Enough for the data of an authentication on a few readers */
+#define AUTH_ARENA_SIZE 4096
+#define TIMING_DIR "timing"
+/* Timings of a reader that did not match for that long are dropped */
+#define TIMING_RECORD_TTL_SEC (30 * 24 * 3600)
+#define READER_KEY_MAX 128
+/* Matches it takes before a reader's history is trusted */
+#define ADAPTIVE_MIN_SAMPLES 5
+/* The deadline is this many times the usual time-to-match */
+#define ADAPTIVE_TIMEOUT_FACTOR 3
 
 #define DEBUG_MATCH "debug="
 #define MAX_TRIES_MATCH "max-tries="
@@ -65,24 +131,89 @@
 #define NO_PTHREAD_MATCH "no-pthread"
 #define NO_PTHREAD_PW_FIRST_MATCH "no-pthread=pw-first"
 #define SUPPRESS_MESSAGES_MATCH "suppress-messages"
+#define BROKER_MATCH "broker"
+#define KEY_DEBOUNCE_MATCH "key-debounce="
+#define ASYNC_RELEASE_MATCH "async-release"
+#define PREWARM_MATCH "prewarm"
+#define TRACE_MATCH "trace"
+#define ENROLL_CACHE_TTL_MATCH "enroll-cache-ttl="
+#define NO_AUTOSTART_MATCH "no-autostart"
+#define MULTI_DEVICE_MATCH "multi-device"
+#define BUS_BUDGET_MATCH "bus-budget="
+#define REAUTH_MATCH "reauth"
+#define REAUTH_IDLE_MATCH "reauth-idle="
+#define READER_BACKOFF_MATCH "reader-backoff"
+#define METRICS_MATCH "metrics"
+#define METRICS_TEXTFILE_MATCH "metrics-textfile="
+#define ADAPTIVE_TIMEOUT_MATCH "adaptive-timeout"
+
+/* Set by applications that can end a pending password prompt, see
+ * prompt_abort() */
+#define PROMPT_ABORT_FD_ENV "PAM_FPRINTD_GROSSHACK_ABORT_FD"
+
+#define TRACE_MESSAGE_ID "4d4b5b0d3e2f4a4f9bb0a6e1c5f2d7a3"
+
+typedef struct
+{
+  bool debug;
+  unsigned max_tries;
+  uint64_t timeout_ms; /* UINT64_MAX for none */
+  bool no_need_enter;
+  bool no_pthread;
+  bool pw_first;
+  bool max_tries_switch_to_pw;
+  bool suppress_messages;
+  bool use_broker;
+  unsigned key_debounce_ms;
+  bool async_release;
+  bool prewarm_enabled;
+  bool trace_enabled;
+  unsigned enroll_cache_ttl;
+  bool no_autostart;
+  bool multi_device;
+  bool adaptive_timeout;
+  uint64_t bus_budget_ms; /* 0 for none */
+  bool reauth;
+  unsigned reauth_idle;
+  bool reader_backoff;
+  bool metrics_enabled;
+  const char *metrics_textfile; /* Points into argv */
+} module_options;
+
+static const module_options default_options = {
+  .max_tries = DEFAULT_MAX_TRIES,
+  .timeout_ms = DEFAULT_TIMEOUT * 1000,
+  .key_debounce_ms = DEFAULT_KEY_DEBOUNCE_MS,
+  .reauth_idle = DEFAULT_REAUTH_IDLE,
+};
+
+/* The options of the invocation running on this thread, set by
+ * pam_sm_authenticate() and by the threads it starts. They are never
+ * modified once parsed, see options_get(). */
+static __thread const module_options *opts = &default_options;
+
+/* Specialised builds, see the "pam_variants" meson option, fix a mode
+ * at compile time so that the compiler drops the code of the other. */
+#ifdef PF_VARIANT_NO_PTHREAD
+#define OPT_NO_PTHREAD true
+#else
+#define OPT_NO_PTHREAD (opts->no_pthread)
+#endif
+#ifdef PF_VARIANT_QUIET
+#define OPT_SUPPRESS_MESSAGES true
+#else
+#define OPT_SUPPRESS_MESSAGES (opts->suppress_messages)
+#endif
+
+/* What is left of the "bus-budget=" of the authentication running on
+ * this thread, in usecs, NULL when there is none. It is shared with the
+ * pre-warm thread. */
+static __thread uint64_t *call_budget = NULL;
 
-static bool debug = false;
-static unsigned max_tries = DEFAULT_MAX_TRIES;
-static unsigned timeout = DEFAULT_TIMEOUT;
-static bool no_need_enter = false;
-static bool no_pthread = false;
-static bool pw_first = false;
-static bool max_tries_switch_to_pw = false;
-static bool suppress_messages = false;
 #define USEC_PER_SEC ((uint64_t)1000000ULL)
 #define NSEC_PER_USEC ((uint64_t)1000ULL)
 #define USEC_PER_MSEC ((uint64_t)1000ULL)
 
-static size_t user_enrolled_prints_num(pam_handle_t *pamh,
-                                       sd_bus *bus,
-                                       const char *dev,
-                                       const char *username);
-
 static uint64_t
 now(void)
 {
@@ -92,6 +223,79 @@ now(void)
   return (uint64_t)ts.tv_sec * USEC_PER_SEC + (uint64_t)ts.tv_nsec / NSEC_PER_USEC;
 }
 
+/* CPU time used by the whole process, that is including the password
+ * thread but also whatever else the host application is doing. */
+static uint64_t
+cpu_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * USEC_PER_SEC + (uint64_t)ts.tv_nsec / NSEC_PER_USEC;
+}
+
+/* Phases of an authentication we keep timings for */
+typedef enum
+{
+  PHASE_BUS_CONNECT,
+  PHASE_BROKER,
+  PHASE_GET_DEVICES,
+  PHASE_LIST_ENROLLED,
+  PHASE_CLAIM,
+  PHASE_VERIFY_START,
+  PHASE_VERIFY_WAIT,
+  PHASE_VERIFY_STOP,
+  PHASE_RELEASE,
+  PHASE_COUNT,
+} auth_phase;
+
+static const char *const auth_phase_names[PHASE_COUNT] = {
+    [PHASE_BUS_CONNECT] = "BUS_CONNECT",
+    [PHASE_BROKER] = "BROKER",
+    [PHASE_GET_DEVICES] = "GET_DEVICES",
+    [PHASE_LIST_ENROLLED] = "LIST_ENROLLED",
+    [PHASE_CLAIM] = "CLAIM",
+    [PHASE_VERIFY_START] = "VERIFY_START",
+    [PHASE_VERIFY_WAIT] = "VERIFY_WAIT",
+    [PHASE_VERIFY_STOP] = "VERIFY_STOP",
+    [PHASE_RELEASE] = "RELEASE",
+};
+
+typedef struct
+{
+  uint64_t started;
+  uint64_t started_cpu;
+  uint64_t prompted;
+  uint64_t matched;
+  uint64_t phase_start[PHASE_COUNT];
+  uint64_t phase_usec[PHASE_COUNT];
+  unsigned retries;
+} auth_trace;
+
+static void
+trace_begin(auth_trace *trace, auth_phase phase)
+{
+  trace->phase_start[phase] = now();
+}
+
+/* Phases can run more than once, e.g. VerifyStart on retries, in
+ * which case their durations add up. */
+static void
+trace_end(auth_trace *trace, auth_phase phase)
+{
+  if (trace->phase_start[phase] == 0)
+    return;
+  trace->phase_usec[phase] += now() - trace->phase_start[phase];
+  trace->phase_start[phase] = 0;
+}
+
+static void
+trace_prompt(auth_trace *trace)
+{
+  if (trace->prompted == 0)
+    trace->prompted = now();
+}
+
 static bool
 str_has_prefix(const char *s, const char *prefix)
 {
@@ -100,16 +304,23 @@ str_has_prefix(const char *s, const char *prefix)
   return strncmp(s, prefix, strlen(prefix)) == 0;
 }
 
+static void
+fd_cleanup(int *fd)
+{
+  if (*fd >= 0)
+    close(*fd);
+}
+
+typedef int fd_int;
+PF_DEFINE_AUTO_CLEAN_FUNC(fd_int, fd_cleanup);
+
 static bool
-send_msg(pam_handle_t *pamh, const char *msg, int style)
+send_msgs(pam_handle_t *pamh, const struct pam_message **msgs, size_t n)
 {
-  const struct pam_message mymsg = {
-      .msg_style = style,
-      .msg = msg,
-  };
-  const struct pam_message *msgp = &mymsg;
   const struct pam_conv *pc;
-  struct pam_response *resp;
+  struct pam_response *resp = NULL;
+  bool ret;
+  size_t i;
 
   if (pam_get_item(pamh, PAM_CONV, (const void **)&pc) != PAM_SUCCESS)
     return false;
@@ -117,531 +328,2038 @@ send_msg(pam_handle_t *pamh, const char *msg, int style)
   if (!pc || !pc->conv)
     return false;
 
-  return pc->conv(1, &msgp, &resp, pc->appdata_ptr) == PAM_SUCCESS;
-}
+  ret = pc->conv(n, msgs, &resp, pc->appdata_ptr) == PAM_SUCCESS;
 
-static bool
-send_info_msg(pam_handle_t *pamh, const char *msg)
-{
-  return send_msg(pamh, msg, PAM_TEXT_INFO);
+  /* Nothing is expected back for informational messages, but the
+   * application may still hand us a response array to free. */
+  if (resp)
+  {
+    for (i = 0; i < n; i++)
+      free(resp[i].resp);
+    free(resp);
+  }
+
+  return ret;
 }
 
-static bool
-send_err_msg(pam_handle_t *pamh, const char *msg)
+/* The messages we send, translated once per locale */
+typedef enum
 {
-  return send_msg(pamh, msg, PAM_ERROR_MSG);
-}
+  MSG_FP_TIMEOUT,
+  MSG_FP_NO_MATCH,
+  MSG_FP_UNKNOWN_ERROR,
+  MSG_SCAN_OR_PRESS_KEY,
+  MSG_FP_OK_PRESS_ENTER,
+  MSG_ENTER_PASSWORD,
+  MSG_COUNT,
+} message_id;
+
+static const char *const message_strings[MSG_COUNT] = {
+  [MSG_FP_TIMEOUT] = N_("FP timeout"),
+  [MSG_FP_NO_MATCH] = N_("FP no match, try again"),
+  [MSG_FP_UNKNOWN_ERROR] = N_("FP unknown error"),
+  [MSG_SCAN_OR_PRESS_KEY] = N_("Scan fingerprint or press any key to enter password"),
+  [MSG_FP_OK_PRESS_ENTER] = N_("Fingerprint OK, press ENTER"),
+  [MSG_ENTER_PASSWORD] = N_("Enter password"),
+};
+
+#define MESSAGE_CACHE_LOCALES 4
+#define MESSAGE_LOCALE_MAX 256
 
-static char *
-open_device(pam_handle_t *pamh,
-            sd_bus *bus,
-            const char *username,
-            bool *has_multiple_devices)
+typedef struct
 {
-  pf_auto(sd_bus_error) error = SD_BUS_ERROR_NULL;
-  pf_autoptr(sd_bus_message) m = NULL;
-  size_t num_devices;
-  size_t max_prints;
-  const char *path = NULL;
-  const char *s;
-  int r;
+  /* LANGUAGE and LC_MESSAGES the strings were looked up for, in place so
+   * that nothing is left to free when the module is unloaded */
+  char locale[MESSAGE_LOCALE_MAX];
+  const char *strings[MSG_COUNT];
+} message_catalog;
+
+/* Shared by the whole process, entries never change once filled in.
+ * dgettext() hands out pointers into the loaded catalogs, which stay
+ * around, so we only keep those. */
+static pthread_mutex_t message_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static message_catalog message_cache[MESSAGE_CACHE_LOCALES];
+
+static const char *
+message_get(message_id id)
+{
+  const char *language = getenv("LANGUAGE");
+  const char *lc_messages = setlocale(LC_MESSAGES, NULL);
+  const char *ret = NULL;
+  char locale[MESSAGE_LOCALE_MAX];
+  size_t i;
+  size_t j;
 
-  *has_multiple_devices = false;
+  snprintf(locale, sizeof(locale), "%s:%s", language ? language : "", lc_messages ? lc_messages : "");
 
-  if (sd_bus_call_method(bus,
-                         "net.reactivated.Fprint",
-                         "/net/reactivated/Fprint/Manager",
-                         "net.reactivated.Fprint.Manager",
-                         "GetDevices",
-                         &error,
-                         &m,
-                         NULL) < 0)
+  pthread_mutex_lock(&message_cache_mutex);
+  for (i = 0; i < MESSAGE_CACHE_LOCALES; i++)
   {
-    pam_syslog(pamh, LOG_ERR, "GetDevices failed: %s", error.message);
-    return NULL;
-  }
+    message_catalog *catalog = &message_cache[i];
 
-  r = sd_bus_message_enter_container(m, 'a', "o");
-  if (r < 0)
-  {
-    pam_syslog(pamh, LOG_ERR, "Failed to parse answer from GetDevices(): %d", r);
-    return NULL;
+    /* Never empty once filled in, it always has the ':' */
+    if (catalog->locale[0] == '\0')
+    {
+      memcpy(catalog->locale, locale, sizeof(locale));
+      for (j = 0; j < MSG_COUNT; j++)
+        catalog->strings[j] = TR(message_strings[j]);
+    }
+    if (str_equal(catalog->locale, locale))
+    {
+      ret = catalog->strings[id];
+      break;
+    }
   }
+  pthread_mutex_unlock(&message_cache_mutex);
 
-  num_devices = 0;
-  max_prints = 0;
-  while (sd_bus_message_read_basic(m, 'o', &s) > 0)
-  {
-    size_t enrolled_prints = user_enrolled_prints_num(pamh, bus, s, username);
+  /* More locales than we keep */
+  return ret ? ret : TR(message_strings[id]);
+}
 
-    if (debug)
-      pam_syslog(pamh, LOG_DEBUG, "%s prints registered: %" PRIu64, s, enrolled_prints);
+/* Informational messages are queued and sent together in one conv()
+ * call, which is a round-trip to the application (and for sshd or a
+ * display manager, to the client). The queue is flushed whenever the
+ * module is about to wait on the user: after starting a scan, before
+ * prompting and before returning. */
+#define MSG_QUEUE_SIZE 4
+/* The same message again within this interval is dropped, e.g. a
+ * reader reporting retry-scan in a tight loop */
+#define MSG_REPEAT_INTERVAL_MS 1000
 
-    if (enrolled_prints > max_prints)
-    {
-      max_prints = enrolled_prints;
-      path = s;
-    }
+typedef struct
+{
+  pam_handle_t *pamh;
+  struct pam_message msgs[MSG_QUEUE_SIZE];
+  size_t len;
+  const char *last_msg;
+  uint64_t last_queued;
+} message_queue;
 
-    num_devices++;
-  }
-  *has_multiple_devices = (num_devices > 1);
-  if (debug)
-    pam_syslog(pamh, LOG_DEBUG, "Using device %s (out of %ld devices)", path, num_devices);
+static bool
+flush_msgs(message_queue *q)
+{
+  const struct pam_message *msgp[MSG_QUEUE_SIZE];
+  size_t i;
+  bool ret;
 
-  sd_bus_message_exit_container(m);
+  if (q->len == 0)
+    return true;
 
-  return path ? strdup(path) : NULL;
+  for (i = 0; i < q->len; i++)
+    msgp[i] = &q->msgs[i];
+  ret = send_msgs(q->pamh, msgp, q->len);
+  q->len = 0;
+
+  return ret;
 }
 
-typedef struct
+static void
+queue_msg(message_queue *q, const char *msg, int style)
 {
-  char *dev;
-  bool has_multiple_devices;
+  uint64_t t = now();
 
-  unsigned max_tries;
-  char *result;
-  bool timed_out;
-  bool is_swipe;
-  bool verify_started;
-  int verify_ret;
-  pam_handle_t *pamh;
+  if (msg == q->last_msg && t - q->last_queued < MSG_REPEAT_INTERVAL_MS * USEC_PER_MSEC)
+    return;
+  q->last_msg = msg;
+  q->last_queued = t;
 
-  char *driver;
+  if (q->len == MSG_QUEUE_SIZE)
+    flush_msgs(q);
 
-  bool stop_got_pw;
-  int pam_prompt_result;
-  pid_t ppid;
-  bool fingerprint_enabled; // Flag to indicate if fingerprint auth is available
-} verify_data;
+  q->msgs[q->len].msg_style = style;
+  q->msgs[q->len].msg = msg;
+  q->len++;
+}
 
 static void
-verify_data_free(verify_data *data)
+queue_info_msg(message_queue *q, const char *msg)
+{
+  queue_msg(q, msg, PAM_TEXT_INFO);
+}
+
+static void
+queue_err_msg(message_queue *q, const char *msg)
 {
-  free(data->result);
-  free(data->driver);
-  free(data->dev);
-  free(data);
+  queue_msg(q, msg, PAM_ERROR_MSG);
 }
 
-PF_DEFINE_AUTOPTR_CLEANUP_FUNC(verify_data, verify_data_free)
+typedef struct
+{
+  pam_handle_t *pamh;
+  const char *path;
+  sd_bus_slot *slot;
+  sd_bus_slot *props_slot; /* In "reader-backoff" mode */
+  char key[READER_KEY_MAX];
+  size_t enrolled_prints;
+  bool replied;
+  bool failed;
+  size_t *pending;
+} discovery_slot;
 
 static int
-verify_result(sd_bus_message *m,
-              void *userdata,
-              sd_bus_error *ret_error)
+list_enrolled_fingers_cb(sd_bus_message *m,
+                         void *userdata,
+                         sd_bus_error *ret_error)
 {
-  verify_data *data = userdata;
-  const char *msg;
-  const char *result = NULL;
-  /* see https://github.com/systemd/systemd/issues/14643 */
-  uint64_t done = false;
+  discovery_slot *slot = userdata;
+  const sd_bus_error *error = sd_bus_message_get_error(m);
+  const char *s;
   int r;
 
-  if (!sd_bus_message_is_signal(m, "net.reactivated.Fprint.Device", "VerifyStatus"))
+  slot->replied = true;
+  (*slot->pending)--;
+
+  if (error)
   {
-    pam_syslog(data->pamh, LOG_ERR, "Not the signal we expected (iface: %s, member: %s)",
-               sd_bus_message_get_interface(m),
-               sd_bus_message_get_member(m));
-    return 0;
+    /* If ListEnrolledFingers fails then verification should
+     * also fail (both use the same underlying call), so we
+     * count no prints for this device. */
+    if (opts->debug)
+      pam_syslog(slot->pamh, LOG_DEBUG, "ListEnrolledFingers failed for %s: %s",
+                 slot->path, error->message);
+    slot->failed = true;
+    return 1;
   }
 
-  if ((r = sd_bus_message_read(m, "sb", &result, &done)) < 0)
+  r = sd_bus_message_enter_container(m, 'a', "s");
+  if (r < 0)
   {
-    pam_syslog(data->pamh, LOG_ERR, "Failed to parse VerifyResult signal: %d", r);
-    data->verify_ret = PAM_AUTHINFO_UNAVAIL;
-    return 0;
+    pam_syslog(slot->pamh, LOG_ERR, "Failed to parse answer from ListEnrolledFingers(): %d", r);
+    slot->failed = true;
+    return 1;
   }
 
-  if (!data->verify_started)
+  while (sd_bus_message_read_basic(m, 's', &s) > 0)
+    slot->enrolled_prints++;
+  sd_bus_message_exit_container(m);
+
+  return 1;
+}
+
+static void
+discovery_slots_free(discovery_slot *slots, size_t num_slots)
+{
+  size_t i;
+
+  /* Dropping the slot of a call that is still in flight cancels it, so
+   * a late reply can never reach a freed discovery_slot. */
+  for (i = 0; i < num_slots; i++)
   {
-    pam_syslog(data->pamh, LOG_ERR, "Unexpected VerifyResult '%s', %" PRIu64 " signal", result, done);
-    return 0;
+    sd_bus_slot_unref(slots[i].slot);
+    sd_bus_slot_unref(slots[i].props_slot);
   }
+  free(slots);
+}
 
-  if (debug)
-    pam_syslog(data->pamh, LOG_DEBUG, "Verify result: %s (done: %d)", result, done ? 1 : 0);
+/* The time spent waiting on fprintd comes out of the budget, the time
+ * spent waiting on the user does not. */
+static void
+call_budget_spend(uint64_t usec)
+{
+  uint64_t left;
+
+  if (!call_budget)
+    return;
+
+  left = __atomic_load_n(call_budget, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(call_budget, &left, left > usec ? left - usec : 0,
+                                      false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static uint64_t
+call_budget_left(void)
+{
+  if (!call_budget)
+    return UINT64_MAX;
+  return __atomic_load_n(call_budget, __ATOMIC_RELAXED);
+}
+
+static bool
+call_budget_exhausted(void)
+{
+  return call_budget_left() == 0;
+}
+
+/* sd_bus_call_method(), but using what is left of the budget as the
+ * timeout instead of the 25 seconds libsystemd defaults to. */
+static int
+call_method(sd_bus *bus,
+            const char *destination,
+            const char *path,
+            const char *interface,
+            const char *member,
+            sd_bus_error *error,
+            sd_bus_message **reply,
+            const char *types,
+            ...)
+{
+  pf_autoptr(sd_bus_message) m = NULL;
+  uint64_t left = call_budget_left();
+  uint64_t start;
+  va_list ap;
+  int r;
+
+  if (left == 0)
+    return sd_bus_error_set_errno(error, -ETIMEDOUT);
+
+  r = sd_bus_message_new_method_call(bus, &m, destination, path, interface, member);
+  if (r < 0)
+    return sd_bus_error_set_errno(error, r);
 
-  if (data->result)
+  if (types)
   {
-    free(data->result);
-    data->result = NULL;
+    va_start(ap, types);
+    r = sd_bus_message_appendv(m, types, ap);
+    va_end(ap);
+    if (r < 0)
+      return sd_bus_error_set_errno(error, r);
   }
 
-  if (done && result)
+  start = now();
+  r = sd_bus_call(bus, m, left == UINT64_MAX ? 0 : left, error, reply);
+  call_budget_spend(now() - start);
+
+  return r;
+}
+
+/* Ask the bus daemon, rather than fprintd itself, whether there is an
+ * fprintd to talk to. Calling fprintd when it is not installed, or when
+ * it cannot start, only fails after a D-Bus activation timeout. */
+static bool
+fprintd_available(pam_handle_t *pamh, sd_bus *bus)
+{
+  pf_auto(sd_bus_error) error = SD_BUS_ERROR_NULL;
+  pf_autoptr(sd_bus_message) m = NULL;
+  int has_owner = false;
+  const char *s;
+  int r;
+
+  r = call_method(bus,
+                  "org.freedesktop.DBus",
+                  "/org/freedesktop/DBus",
+                  "org.freedesktop.DBus",
+                  "NameHasOwner",
+                  &error,
+                  &m,
+                  "s",
+                  "net.reactivated.Fprint");
+  if (r < 0 || sd_bus_message_read(m, "b", &has_owner) < 0)
   {
-    data->result = strdup(result);
-    return 0;
+    /* Let the actual calls find out what is wrong */
+    if (opts->debug)
+      pam_syslog(pamh, LOG_DEBUG, "NameHasOwner failed: %s", error.message);
+    return true;
   }
+  if (has_owner)
+    return true;
+  if (opts->no_autostart)
+    return false;
 
-  // For intermediate failures, just log to syslog instead of showing user messages
-  // to avoid blocking modal dialogs in polkit
-  msg = verify_result_str_to_msg(result, data->is_swipe);
-  if (msg)
+  m = sd_bus_message_unref(m);
+  r = call_method(bus,
+                  "org.freedesktop.DBus",
+                  "/org/freedesktop/DBus",
+                  "org.freedesktop.DBus",
+                  "ListActivatableNames",
+                  &error,
+                  &m,
+                  NULL);
+  if (r < 0 || sd_bus_message_enter_container(m, 'a', "s") < 0)
   {
-    if (debug)
-      pam_syslog(data->pamh, LOG_DEBUG, "Intermediate verify result: %s", msg);
+    if (opts->debug)
+      pam_syslog(pamh, LOG_DEBUG, "ListActivatableNames failed: %s", error.message);
+    return true;
   }
-  else
+  while (sd_bus_message_read_basic(m, 's', &s) > 0)
   {
-    data->result = strdup("Protocol error with fprintd!");
-    return 0;
+    if (str_equal(s, "net.reactivated.Fprint"))
+      return true;
   }
 
-  return 0;
+  return false;
 }
 
+/* Not pam_modutil_getpwnam(), as that stores its result on the handle
+ * and we may be running on the pre-warm thread. */
 static int
-verify_finger_selected(sd_bus_message *m,
-                       void *userdata,
-                       sd_bus_error *ret_error)
+lookup_uid(const char *username, uid_t *ret_uid)
 {
-  verify_data *data = userdata;
-  const char *finger_name = NULL;
-  pf_autofree char *msg = NULL;
-
-  if (sd_bus_message_read_basic(m, 's', &finger_name) < 0)
-  {
-    pam_syslog(data->pamh, LOG_ERR, "Failed to parse VerifyFingerSelected signal: %d", errno);
-    data->verify_ret = PAM_AUTHINFO_UNAVAIL;
-    return 0;
-  }
+  struct passwd pwbuf;
+  struct passwd *pw = NULL;
+  char pw_strings[4096];
 
-  if (!data->verify_started)
-  {
-    pam_syslog(data->pamh, LOG_ERR, "Unexpected VerifyFingerSelected %s signal", finger_name);
-    return 0;
-  }
+  if (getpwnam_r(username, &pwbuf, pw_strings, sizeof(pw_strings), &pw) != 0 || !pw)
+    return -ENOENT;
 
-  msg = finger_str_to_msg(finger_name, data->driver, data->is_swipe);
-  if (!msg)
-  {
-    data->result = strdup("Protocol error with fprintd!");
-    return 0;
-  }
-  if (debug)
-    pam_syslog(data->pamh, LOG_DEBUG, "verify_finger_selected %s", msg);
-  // send_info_msg (data->pamh, msg);
+  *ret_uid = pw->pw_uid;
   return 0;
 }
 
-/* See https://github.com/systemd/systemd/issues/14636 */
+/* Ask the session broker for the device to use, see fprintd-broker.h.
+ * Returns 1 with *ret_dev set if the broker picked a device, 0 if it
+ * knows that no device has prints enrolled, and a negative value if
+ * there is no (trustworthy) broker and discovery must be done here. */
 static int
-get_property_string(sd_bus *bus,
-                    const char *destination,
-                    const char *path,
-                    const char *interface,
-                    const char *member,
-                    sd_bus_error *error,
-                    char **ret)
+broker_lookup(pam_handle_t *pamh,
+              const char *username,
+              char **ret_dev,
+              bool *has_multiple_devices)
 {
-
-  pf_autoptr(sd_bus_message) reply = NULL;
-  const char *s;
-  char *n;
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  struct pollfd pfd;
+  char request[BROKER_MAX_LINE];
+  char reply[BROKER_MAX_LINE];
+  char path[BROKER_MAX_LINE];
+  size_t num_devices = 0;
+  size_t enrolled_prints = 0;
+  size_t len = 0;
+  uint64_t broker_end;
+  fd_int fd = -1;
+  uid_t uid;
   int r;
 
-  r = sd_bus_call_method(bus, destination, path, "org.freedesktop.DBus.Properties", "Get", error, &reply, "ss", interface, member);
+  r = lookup_uid(username, &uid);
   if (r < 0)
     return r;
 
-  r = sd_bus_message_enter_container(reply, 'v', "s");
-  if (r < 0)
-    return sd_bus_error_set_errno(error, r);
+  r = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%u/%s",
+               BROKER_RUNTIME_DIR, (unsigned)uid, BROKER_SOCKET_NAME);
+  if (r < 0 || (size_t)r >= sizeof(addr.sun_path))
+    return -ENAMETOOLONG;
 
-  r = sd_bus_message_read_basic(reply, 's', &s);
-  if (r < 0)
-    return sd_bus_error_set_errno(error, r);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+    return -errno;
 
-  n = strdup(s);
-  if (!n)
-    return sd_bus_error_set_errno(error, -ENOMEM);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    if (opts->debug)
+      pam_syslog(pamh, LOG_DEBUG, "No broker at %s: %s", addr.sun_path, strerror(errno));
+    return -errno;
+  }
 
-  *ret = n;
-  return 0;
-}
+  /* Only the user itself or root may tell us which reader to use */
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+      (cred.uid != uid && cred.uid != 0))
+  {
+    pam_syslog(pamh, LOG_WARNING, "Ignoring broker %s not owned by %s", addr.sun_path, username);
+    return -EPERM;
+  }
 
-static int
-verify_started_cb(sd_bus_message *m,
-                  void *userdata,
-                  sd_bus_error *ret_error)
+  r = snprintf(request, sizeof(request), "%s %s\n", BROKER_REQUEST_LOOKUP, username);
+  if (r < 0 || (size_t)r >= sizeof(request))
+    return -ENAMETOOLONG;
+  if (write(fd, request, r) != r)
+    return -EIO;
+
+  broker_end = now() + BROKER_TIMEOUT_MS * USEC_PER_MSEC;
+  while (len < sizeof(reply) - 1 && !memchr(reply, '\n', len))
+  {
+    int64_t wait_time = broker_end - now();
+    ssize_t n;
+
+    if (wait_time <= 0)
+    {
+      if (opts->debug)
+        pam_syslog(pamh, LOG_DEBUG, "Broker did not answer in time");
+      return -ETIMEDOUT;
+    }
+
+    pfd = (struct pollfd){.fd = fd, .events = POLLIN};
+    r = poll(&pfd, 1, wait_time / USEC_PER_MSEC);
+    if (r < 0 && errno != EINTR)
+      return -errno;
+    if (r <= 0)
+      continue;
+
+    n = read(fd, reply + len, sizeof(reply) - 1 - len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      continue;
+    if (n <= 0)
+      return -EIO;
+    len += n;
+  }
+  reply[len] = '\0';
+
+  if (sscanf(reply, BROKER_REPLY_OK " %zu %zu %511s", &num_devices, &enrolled_prints, path) == 3 &&
+      str_has_prefix(path, BROKER_DEVICE_PREFIX))
+  {
+    if (opts->debug)
+      pam_syslog(pamh, LOG_DEBUG, "Broker picked device %s (%" PRIu64 " prints, %" PRIu64 " devices)",
+                 path, enrolled_prints, num_devices);
+    *ret_dev = strdup(path);
+    if (!*ret_dev)
+      return -ENOMEM;
+    *has_multiple_devices = (num_devices > 1);
+    return 1;
+  }
+
+  if (sscanf(reply, BROKER_REPLY_NONE " %zu", &num_devices) == 1)
+  {
+    if (opts->debug)
+      pam_syslog(pamh, LOG_DEBUG, "Broker reports no prints on %" PRIu64 " devices", num_devices);
+    *has_multiple_devices = (num_devices > 1);
+    return 0;
+  }
+
+  if (opts->debug)
+    pam_syslog(pamh, LOG_DEBUG, "Broker could not answer, doing discovery");
+  return -EAGAIN;
+}
+
+/* In "multi-device" mode discovery also hands out the other devices with
+ * prints, as a NULL-terminated array of up to MAX_READERS - 1 entries. */
+static void
+peer_devs_add(char **peer_devs, const char *dev)
+{
+  size_t i;
+
+  if (!peer_devs)
+    return;
+
+  for (i = 0; i < MAX_READERS - 1; i++)
+  {
+    if (!peer_devs[i])
+    {
+      peer_devs[i] = strdup(dev);
+      return;
+    }
+  }
+}
+
+static void
+peer_devs_free(char **peer_devs)
+{
+  size_t i;
+
+  for (i = 0; i < MAX_READERS - 1; i++)
+  {
+    free(peer_devs[i]);
+    peer_devs[i] = NULL;
+  }
+}
+
+/* The enrollment cache remembers, per user, how many prints each device
+ * had at the last complete discovery, one "<device-path> <prints>" line
+ * per device. fprintd cannot tell us about changes while we are not
+ * loaded, so an entry is only trusted for enroll_cache_ttl seconds and
+ * only while fprintd's storage for the user is older than it. */
+static bool
+enroll_cache_name(const char *username, char *buf, size_t len)
+{
+  uid_t uid;
+  int r;
+
+  if (lookup_uid(username, &uid) < 0)
+    return false;
+
+  r = snprintf(buf, len, "%u", (unsigned)uid);
+  return r > 0 && (size_t)r < len;
+}
+
+/* Newest modification time of a directory and its subdirectories, down
+ * to depth levels. Takes ownership of dir_fd. */
+static time_t
+dir_tree_mtime(int dir_fd, unsigned depth)
+{
+  struct dirent *de;
+  struct stat st;
+  time_t newest;
+  DIR *dir;
+
+  if (fstat(dir_fd, &st) < 0)
+  {
+    close(dir_fd);
+    return 0;
+  }
+  newest = st.st_mtime;
+
+  if (depth == 0 || !(dir = fdopendir(dir_fd)))
+  {
+    close(dir_fd);
+    return newest;
+  }
+
+  while ((de = readdir(dir)))
+  {
+    int fd;
+
+    if (de->d_name[0] == '.')
+      continue;
+
+    fd = openat(dirfd(dir), de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd >= 0)
+      newest = MAX(newest, dir_tree_mtime(fd, depth - 1));
+  }
+  closedir(dir);
+
+  return newest;
+}
+
+/* fprintd stores prints as STORAGE_PATH/<user>/<driver>/<device>/<finger>,
+ * so enrolling or deleting one changes a directory along that path. This
+ * is only readable when running as root, otherwise the TTL has to do. */
+static time_t
+storage_mtime(const char *username)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  time_t newest = 0;
+  int fd;
+  int r;
+
+  if (stat(STORAGE_PATH, &st) == 0)
+    newest = st.st_mtime;
+
+  r = snprintf(path, sizeof(path), "%s/%s", STORAGE_PATH, username);
+  if (r < 0 || (size_t)r >= sizeof(path))
+    return newest;
+
+  fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd >= 0)
+    newest = MAX(newest, dir_tree_mtime(fd, 2));
+
+  return newest;
+}
+
+/* Returns 1 with *ret_dev set if the cache names a device with prints,
+ * 0 if it knows that no device has any, and a negative value if there
+ * is no fresh entry and discovery must be done. */
+static int
+enroll_cache_lookup(pam_handle_t *pamh,
+                    const char *username,
+                    char **ret_dev,
+                    char **ret_peer_devs,
+                    bool *has_multiple_devices)
+{
+  char name[32];
+  char buf[ENROLL_CACHE_MAX];
+  char *saveptr = NULL;
+  char *line;
+  char *dev = NULL;
+  size_t num_devices = 0;
+  size_t max_prints = 0;
+  struct stat st;
+  time_t wall_now;
+  ssize_t n;
+
+  if (!enroll_cache_name(username, name, sizeof(name)))
+    return -ENOENT;
+
+  n = state_file_read(ENROLL_CACHE_DIR, name, buf, sizeof(buf), &st);
+  if (n < 0)
+    return n;
+
+  wall_now = time(NULL);
+  if (st.st_mtime > wall_now ||
+      st.st_mtime + (time_t)opts->enroll_cache_ttl <= wall_now ||
+      storage_mtime(username) >= st.st_mtime)
+  {
+    if (opts->debug)
+      pam_syslog(pamh, LOG_DEBUG, "Enrollment cache for %s is stale", username);
+    return -ESTALE;
+  }
+
+  for (line = strtok_r(buf, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr))
+  {
+    char path[STATE_PATH_MAX];
+    size_t prints;
+
+    if (sscanf(line, "%255s %zu", path, &prints) != 2 ||
+        !str_has_prefix(path, BROKER_DEVICE_PREFIX))
+    {
+      pam_syslog(pamh, LOG_WARNING, "Ignoring malformed enrollment cache for %s", username);
+      if (ret_peer_devs)
+        peer_devs_free(ret_peer_devs);
+      free(dev);
+      return -EINVAL;
+    }
+
+    num_devices++;
+    if (prints > max_prints)
+    {
+      char *new_dev = strdup(path);
+
+      if (!new_dev)
+      {
+        if (ret_peer_devs)
+          peer_devs_free(ret_peer_devs);
+        free(dev);
+        return -ENOMEM;
+      }
+      if (dev)
+        peer_devs_add(ret_peer_devs, dev);
+      free(dev);
+      dev = new_dev;
+      max_prints = prints;
+    }
+    else if (prints > 0)
+    {
+      peer_devs_add(ret_peer_devs, path);
+    }
+  }
+
+  if (opts->debug)
+    pam_syslog(pamh, LOG_DEBUG, "Enrollment cache for %s: %s (%" PRIu64 " prints, %" PRIu64 " devices)",
+               username, dev ? dev : "no prints", max_prints, num_devices);
+
+  *ret_dev = dev;
+  *has_multiple_devices = (num_devices > 1);
+  return dev ? 1 : 0;
+}
+
+static void
+enroll_cache_store(pam_handle_t *pamh,
+                   const char *username,
+                   const discovery_slot *slots,
+                   size_t num_slots)
+{
+  char name[32];
+  char buf[ENROLL_CACHE_MAX];
+  size_t len = 0;
+  size_t i;
+  int r;
+
+  if (!enroll_cache_name(username, name, sizeof(name)))
+    return;
+
+  for (i = 0; i < num_slots; i++)
+  {
+    r = snprintf(buf + len, sizeof(buf) - len, "%s %zu\n",
+                 slots[i].path, slots[i].enrolled_prints);
+    if (r < 0 || (size_t)r >= sizeof(buf) - len)
+      return;
+    len += r;
+  }
+
+  r = state_file_write(ENROLL_CACHE_DIR, name, buf, len);
+  if (r < 0 && opts->debug)
+    pam_syslog(pamh, LOG_DEBUG, "Not caching enrolled prints: %s", strerror(-r));
+}
+
+/* Called whenever fprintd contradicts the cache */
+static void
+enroll_cache_invalidate(const char *username)
+{
+  char name[32];
+
+  if (opts->enroll_cache_ttl > 0 && enroll_cache_name(username, name, sizeof(name)))
+    state_file_remove(ENROLL_CACHE_DIR, name);
+}
+
+/* Records about a reader are kept under its name and scan type, not
+ * under its object path: fprintd numbers devices in the order it finds
+ * them, so a replugged reader gets a new path, and after a restart of
+ * fprintd an old path may belong to another reader. Identical readers
+ * share their records. Returns false if there is no name to go by. */
+static bool
+reader_key(char *buf, size_t len, const char *name, const char *scan_type)
+{
+  size_t n = 0;
+  int r;
+
+  if (!name || *name == '\0')
+    return false;
+
+  for (; *name != '\0' && n < len - 1; name++)
+  {
+    char c = *name;
+
+    buf[n++] = ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) ? c : '_';
+  }
+
+  r = snprintf(buf + n, len - n, "-%s", str_equal(scan_type, "swipe") ? "swipe" : "press");
+  return r >= 0 && (size_t)r < len - n;
+}
+
+/* What we learnt about a reader from its past matches: how long after
+ * VerifyStart the match usually comes, and how many retry-scan style
+ * results it usually takes, as moving averages. */
+typedef struct
+{
+  unsigned samples;
+  uint64_t match_ms;
+  unsigned retries_pct; /* retry results per match, in percent */
+} reader_timing;
+
+static void
+timing_load(const char *key, reader_timing *t)
+{
+  char buf[64];
+
+  *t = (reader_timing){0};
+  if (*key == '\0' || state_file_read(TIMING_DIR, key, buf, sizeof(buf), NULL) <= 0)
+    return;
+  if (sscanf(buf, "%u %" SCNu64 " %u", &t->samples, &t->match_ms, &t->retries_pct) != 3)
+    *t = (reader_timing){0};
+}
+
+/* Weighs the new sample by 1/4, so that a reader that got slower, or a
+ * user who got used to it, is followed within a few authentications */
+static uint64_t
+timing_average(uint64_t avg, uint64_t sample, unsigned samples)
+{
+  if (samples == 0)
+    return sample;
+  return (3 * avg + sample) / 4;
+}
+
+static void
+timing_record(const char *key, reader_timing *t, uint64_t match_ms, unsigned retries)
+{
+  char buf[64];
+  int len;
+
+  if (*key == '\0')
+    return;
+
+  t->match_ms = timing_average(t->match_ms, match_ms, t->samples);
+  t->retries_pct = timing_average(t->retries_pct, retries * 100, t->samples);
+  if (t->samples < UINT_MAX)
+    t->samples++;
+
+  len = snprintf(buf, sizeof(buf), "%u %" PRIu64 " %u\n", t->samples, t->match_ms, t->retries_pct);
+  if (len > 0 && (size_t)len < sizeof(buf))
+    state_file_write(TIMING_DIR, key, buf, len);
+  state_dir_expire(TIMING_DIR, TIMING_RECORD_TTL_SEC);
+}
+
+static void
+metrics_count_failure(void)
+{
+  auth_metrics *m;
+
+  if (opts->metrics_enabled && (m = metrics_get()))
+    metrics_add(&m->fprintd_failures, 1);
+}
+
+/* Health of a reader, in "reader-backoff" mode: how many times in a row
+ * it failed, and when it last did. Both the monotonic clock and /run
+ * start over on boot. */
+typedef struct
+{
+  unsigned failures;
+  uint64_t failed_at;
+} reader_health;
+
+static bool
+health_load(const char *key, reader_health *h)
+{
+  char buf[64];
+
+  if (*key == '\0' || state_file_read(HEALTH_DIR, key, buf, sizeof(buf), NULL) <= 0)
+    return false;
+
+  return sscanf(buf, "%u %" SCNu64, &h->failures, &h->failed_at) == 2 && h->failures > 0;
+}
+
+/* Whether a reader that kept failing is still sitting out its backoff */
+static bool
+health_held_back(pam_handle_t *pamh, const char *key)
+{
+  reader_health h;
+  uint64_t backoff;
+
+  if (!opts->reader_backoff || !health_load(key, &h))
+    return false;
+
+  backoff = (uint64_t)HEALTH_BACKOFF_BASE_SEC << MIN(h.failures - 1, 16u);
+  if (backoff > HEALTH_BACKOFF_MAX_SEC)
+    backoff = HEALTH_BACKOFF_MAX_SEC;
+  if (now() >= h.failed_at + backoff * USEC_PER_SEC)
+    return false;
+
+  if (opts->debug)
+    pam_syslog(pamh, LOG_DEBUG, "Skipping %s, it failed %u times in a row, retrying in %" PRIu64 " secs",
+               key, h.failures, (h.failed_at + backoff * USEC_PER_SEC - now()) / USEC_PER_SEC);
+  return true;
+}
+
+static void
+health_record_failure(const char *key)
+{
+  reader_health h = {0};
+  char buf[64];
+  int len;
+
+  if (!opts->reader_backoff || *key == '\0')
+    return;
+
+  /* Failures that long apart are not a streak */
+  if (health_load(key, &h) && now() - h.failed_at > HEALTH_RECORD_TTL_SEC * USEC_PER_SEC)
+    h.failures = 0;
+  if (h.failures < UINT_MAX)
+    h.failures++;
+  h.failed_at = now();
+
+  len = snprintf(buf, sizeof(buf), "%u %" PRIu64 "\n", h.failures, h.failed_at);
+  if (len > 0 && (size_t)len < sizeof(buf))
+    state_file_write(HEALTH_DIR, key, buf, len);
+  state_dir_expire(HEALTH_DIR, HEALTH_RECORD_TTL_SEC);
+}
+
+static void
+health_record_ok(const char *key)
+{
+  if (!opts->reader_backoff || *key == '\0')
+    return;
+
+  state_file_remove(HEALTH_DIR, key);
+}
+
+/* Reads the key of a reader out of a Properties.GetAll() reply */
+static int
+read_reader_key(sd_bus_message *m, char *buf, size_t len)
+{
+  const char *name = NULL;
+  const char *scan_type = NULL;
+  const char *key;
+  int r;
+
+  r = sd_bus_message_enter_container(m, 'a', "{sv}");
+  if (r < 0)
+    return r;
+
+  while ((r = sd_bus_message_enter_container(m, 'e', "sv")) > 0)
+  {
+    r = sd_bus_message_read_basic(m, 's', &key);
+    if (r < 0)
+      return r;
+
+    if (str_equal(key, "name"))
+      r = sd_bus_message_read(m, "v", "s", &name);
+    else if (str_equal(key, "scan-type"))
+      r = sd_bus_message_read(m, "v", "s", &scan_type);
+    else
+      r = sd_bus_message_skip(m, "v");
+    if (r < 0)
+      return r;
+
+    r = sd_bus_message_exit_container(m);
+    if (r < 0)
+      return r;
+  }
+  if (r < 0)
+    return r;
+
+  return reader_key(buf, len, name, scan_type) ? 0 : -ENODATA;
+}
+
+/* For the device named by the enrollment cache or the broker, at the
+ * cost of a round-trip, which is only paid in "reader-backoff" mode */
+static bool
+reader_held_back(pam_handle_t *pamh, sd_bus *bus, const char *dev)
+{
+  pf_auto(sd_bus_error) error = SD_BUS_ERROR_NULL;
+  pf_autoptr(sd_bus_message) m = NULL;
+  char key[READER_KEY_MAX];
+
+  if (!opts->reader_backoff)
+    return false;
+
+  if (call_method(bus,
+                  "net.reactivated.Fprint",
+                  dev,
+                  "org.freedesktop.DBus.Properties",
+                  "GetAll",
+                  &error,
+                  &m,
+                  "s",
+                  "net.reactivated.Fprint.Device") < 0 ||
+      read_reader_key(m, key, sizeof(key)) < 0)
+    return false;
+
+  return health_held_back(pamh, key);
+}
+
+static int
+reader_key_cb(sd_bus_message *m,
+              void *userdata,
+              sd_bus_error *ret_error)
+{
+  discovery_slot *slot = userdata;
+
+  (*slot->pending)--;
+  if (sd_bus_message_is_method_error(m, NULL) ||
+      read_reader_key(m, slot->key, sizeof(slot->key)) < 0)
+    slot->key[0] = '\0';
+
+  return 1;
+}
+
+/* The deadline for one attempt on a reader. Fast readers get a shorter
+ * one, so that a missed finger gets to the password sooner, and readers
+ * that often ask to scan again, like swipe sensors, a longer one. It
+ * stays between MIN_TIMEOUT and twice the configured timeout. */
+static uint64_t
+timing_deadline_ms(const reader_timing *t)
+{
+  uint64_t deadline;
+
+  if (!opts->adaptive_timeout || opts->timeout_ms == UINT64_MAX ||
+      t->samples < ADAPTIVE_MIN_SAMPLES)
+    return opts->timeout_ms;
+
+  deadline = t->match_ms * ADAPTIVE_TIMEOUT_FACTOR +
+             t->match_ms * t->retries_pct / 100;
+  if (deadline < MIN_TIMEOUT * 1000)
+    deadline = MIN_TIMEOUT * 1000;
+  if (deadline > 2 * opts->timeout_ms)
+    deadline = 2 * opts->timeout_ms;
+
+  return deadline;
+}
+
+static char *
+open_device(pam_handle_t *pamh,
+            sd_bus *bus,
+            const char *username,
+            bool *has_multiple_devices,
+            char **ret_peer_devs,
+            auth_trace *trace)
+{
+  pf_auto(sd_bus_error) error = SD_BUS_ERROR_NULL;
+  pf_autoptr(sd_bus_message) m = NULL;
+  discovery_slot *slots = NULL;
+  size_t num_devices;
+  size_t max_prints;
+  size_t pending;
+  size_t i;
+  bool complete;
+  uint64_t discovery_start;
+  uint64_t discovery_end;
+  const char *path = NULL;
+  char *ret = NULL;
+  const char *s;
+  int r;
+
+  *has_multiple_devices = false;
+
+  if (opts->enroll_cache_ttl > 0)
+  {
+    char *dev = NULL;
+
+    if (enroll_cache_lookup(pamh, username, &dev, ret_peer_devs, has_multiple_devices) >= 0)
+    {
+      if (!dev || !reader_held_back(pamh, bus, dev))
+        return dev;
+
+      /* Discovery skips the reader that is held back, and picks the
+       * best of the others */
+      free(dev);
+      if (ret_peer_devs)
+        peer_devs_free(ret_peer_devs);
+      *has_multiple_devices = false;
+    }
+  }
+
+  /* The broker only ever names one device */
+  if (opts->use_broker && !ret_peer_devs)
+  {
+    char *dev = NULL;
+
+    trace_begin(trace, PHASE_BROKER);
+    r = broker_lookup(pamh, username, &dev, has_multiple_devices);
+    trace_end(trace, PHASE_BROKER);
+    if (r >= 0)
+    {
+      if (!dev || !reader_held_back(pamh, bus, dev))
+        return dev;
+
+      free(dev);
+      *has_multiple_devices = false;
+    }
+  }
+
+  trace_begin(trace, PHASE_GET_DEVICES);
+  r = call_method(bus,
+                  "net.reactivated.Fprint",
+                  "/net/reactivated/Fprint/Manager",
+                  "net.reactivated.Fprint.Manager",
+                  "GetDevices",
+                  &error,
+                  &m,
+                  NULL);
+  trace_end(trace, PHASE_GET_DEVICES);
+  if (r < 0)
+  {
+    pam_syslog(pamh, LOG_ERR, "GetDevices failed: %s", error.message);
+    return NULL;
+  }
+
+  r = sd_bus_message_enter_container(m, 'a', "o");
+  if (r < 0)
+  {
+    pam_syslog(pamh, LOG_ERR, "Failed to parse answer from GetDevices(): %d", r);
+    return NULL;
+  }
+
+  num_devices = 0;
+  while (sd_bus_message_read_basic(m, 'o', &s) > 0)
+  {
+    discovery_slot *new_slots;
+
+    new_slots = realloc(slots, (num_devices + 1) * sizeof(discovery_slot));
+    if (!new_slots)
+    {
+      pam_syslog(pamh, LOG_ERR, "Failed to allocate discovery slots");
+      break;
+    }
+    slots = new_slots;
+    slots[num_devices] = (discovery_slot){
+        .pamh = pamh,
+        .path = s,
+        .pending = &pending,
+    };
+    num_devices++;
+  }
+  sd_bus_message_exit_container(m);
+
+  /* Queue one ListEnrolledFingers call per device, all at once, so that
+   * discovery costs a single round-trip however many readers there are. */
+  trace_begin(trace, PHASE_LIST_ENROLLED);
+  pending = 0;
+  for (i = 0; i < num_devices; i++)
+  {
+    /* Held-back readers are only known by their properties, which come
+     * in the same round-trip */
+    if (opts->reader_backoff &&
+        sd_bus_call_method_async(bus,
+                                 &slots[i].props_slot,
+                                 "net.reactivated.Fprint",
+                                 slots[i].path,
+                                 "org.freedesktop.DBus.Properties",
+                                 "GetAll",
+                                 reader_key_cb,
+                                 &slots[i],
+                                 "s",
+                                 "net.reactivated.Fprint.Device") >= 0)
+      pending++;
+
+    r = sd_bus_call_method_async(bus,
+                                 &slots[i].slot,
+                                 "net.reactivated.Fprint",
+                                 slots[i].path,
+                                 "net.reactivated.Fprint.Device",
+                                 "ListEnrolledFingers",
+                                 list_enrolled_fingers_cb,
+                                 &slots[i],
+                                 "s",
+                                 username);
+    if (r < 0)
+    {
+      if (opts->debug)
+        pam_syslog(pamh, LOG_DEBUG, "ListEnrolledFingers call failed for %s: %d", slots[i].path, r);
+      continue;
+    }
+    pending++;
+  }
+
+  discovery_start = now();
+  discovery_end = discovery_start + MIN(DISCOVERY_TIMEOUT_MS * USEC_PER_MSEC, call_budget_left());
+  while (pending > 0)
+  {
+    int64_t wait_time;
+
+    r = sd_bus_process(bus, NULL);
+    if (r < 0)
+    {
+      pam_syslog(pamh, LOG_ERR, "Failed to process discovery replies: %d", r);
+      break;
+    }
+    if (r > 0)
+      continue;
+
+    wait_time = discovery_end - now();
+    if (wait_time <= 0)
+    {
+      if (opts->debug)
+        pam_syslog(pamh, LOG_DEBUG, "Discovery deadline reached with %ld replies pending", pending);
+      break;
+    }
+
+    r = sd_bus_wait(bus, wait_time);
+    if (r < 0 && r != -EINTR)
+    {
+      pam_syslog(pamh, LOG_ERR, "Error waiting for discovery replies: %d", r);
+      break;
+    }
+  }
+
+  trace_end(trace, PHASE_LIST_ENROLLED);
+  call_budget_spend(now() - discovery_start);
+
+  max_prints = 0;
+  complete = (pending == 0);
+  for (i = 0; i < num_devices; i++)
+  {
+    /* Not using a flapping reader, the enrollment cache is not stored
+     * either then */
+    if (slots[i].key[0] != '\0' && health_held_back(pamh, slots[i].key))
+    {
+      slots[i].failed = true;
+      slots[i].enrolled_prints = 0;
+    }
+
+    if (!slots[i].replied || slots[i].failed)
+      complete = false;
+
+    if (opts->debug)
+      pam_syslog(pamh, LOG_DEBUG, "%s prints registered: %" PRIu64 "%s", slots[i].path,
+                 slots[i].enrolled_prints, slots[i].replied ? "" : " (no reply)");
+
+    if (slots[i].enrolled_prints > max_prints)
+    {
+      if (path)
+        peer_devs_add(ret_peer_devs, path);
+      max_prints = slots[i].enrolled_prints;
+      path = slots[i].path;
+    }
+    else if (slots[i].enrolled_prints > 0)
+    {
+      peer_devs_add(ret_peer_devs, slots[i].path);
+    }
+  }
+
+  *has_multiple_devices = (num_devices > 1);
+  if (opts->debug)
+    pam_syslog(pamh, LOG_DEBUG, "Using device %s (out of %ld devices)", path, num_devices);
+
+  if (opts->enroll_cache_ttl > 0 && complete)
+    enroll_cache_store(pamh, username, slots, num_devices);
+
+  if (path)
+    ret = strdup(path);
+  discovery_slots_free(slots, num_devices);
+
+  return ret;
+}
+
+typedef struct
+{
+  char *dev; /* The device these properties were fetched for */
+  char *name;
+  char *scan_type;
+  int32_t num_enroll_stages;
+  bool finger_present;
+  bool finger_needed;
+} device_properties;
+
+/* The strings are allocated from the arena of the authentication */
+static void
+device_properties_clear(device_properties *props)
+{
+  *props = (device_properties){0};
+}
+
+typedef struct verify_data
+{
+  pf_arena *arena; /* Of the primary, it holds everything below */
+  char *dev;
+  bool has_multiple_devices;
+
+  unsigned max_tries;
+  VerifyResult result; /* Final result of the current attempt */
+  bool timed_out;
+  bool is_swipe;
+  bool verify_started;
+  sd_bus_slot *verify_start_slot; /* Until VerifyStart replied */
+  int verify_ret;
+  pam_handle_t *pamh;
+  const char *username;
+  message_queue msgs; /* Only touched by the thread running do_auth() */
+
+  uint64_t call_budget; /* See call_budget */
+
+  char reader_key[READER_KEY_MAX]; /* Empty if the reader has no name */
+  reader_timing timing;
+  uint64_t armed_at;
+  unsigned retry_scans;
+
+  device_properties props;
+  const char *driver;
+  char *finger_msgs[FINGER_UNKNOWN]; /* Only formatted for debugging */
+
+  bool stop_got_pw;
+  int pam_prompt_result;
+  int wakeup_fd; /* Written by the password thread once it is done */
+  pthread_mutex_t input_mutex; /* Shared with the password thread */
+  pthread_cond_t armed_cond;
+  bool verify_armed; /* VerifyStart replied, or verification is over */
+  bool fingerprint_enabled; // Flag to indicate if fingerprint auth is available
+  bool fingerprint_success;
+  bool fingerprint_finished;
+
+  auth_trace trace;
+  const module_options *opts; /* For the threads we start */
+
+  /* "multi-device": the other claimed readers, raced against dev. Each
+   * peer has its own verify_data, pointing back at the primary one. */
+  struct verify_data *primary;
+  struct verify_data **peers;
+  size_t num_peers;
+  bool dropped; /* VerifyStart failed, sitting out this verification */
+} verify_data;
+
+/* Drops what the arena cannot free for us */
+static void
+verify_data_destroy(verify_data *data)
+{
+  size_t i;
+
+  for (i = 0; i < data->num_peers; i++)
+    verify_data_destroy(data->peers[i]);
+  sd_bus_slot_unref(data->verify_start_slot);
+  if (data->wakeup_fd >= 0)
+    close(data->wakeup_fd);
+  pthread_cond_destroy(&data->armed_cond);
+  pthread_mutex_destroy(&data->input_mutex);
+}
+
+static void
+verify_data_free(verify_data *data)
+{
+  verify_data_destroy(data);
+  pf_arena_free(data->arena);
+}
+
+/* The handle owns the state of the authentication in progress, so that
+ * it is gone with pam_end() whichever way we leave do_auth(). */
+#define AUTH_DATA_KEY "pam_fprintd_grosshack_auth"
+
+static void
+verify_data_cleanup(pam_handle_t *pamh, void *data, int error_status)
+{
+  verify_data_free(data);
+}
+
+/* Let the password thread know it can show its prompt */
+static void
+verify_set_armed(verify_data *data)
+{
+  pthread_mutex_lock(&data->input_mutex);
+  data->verify_armed = true;
+  pthread_cond_broadcast(&data->armed_cond);
+  pthread_mutex_unlock(&data->input_mutex);
+}
+
+static void
+wakeup_verify(verify_data *data)
+{
+  if (data->wakeup_fd >= 0 && eventfd_write(data->wakeup_fd, 1) < 0)
+    pam_syslog(data->pamh, LOG_ERR, "Failed to wake up verify loop: %s", strerror(errno));
+}
+
+static int
+verify_result(sd_bus_message *m,
+              void *userdata,
+              sd_bus_error *ret_error)
+{
+  verify_data *data = userdata;
+  const char *msg;
+  const char *result = NULL;
+  VerifyResult value;
+  /* see https://github.com/systemd/systemd/issues/14643 */
+  uint64_t done = false;
+  int r;
+
+  if (!sd_bus_message_is_signal(m, "net.reactivated.Fprint.Device", "VerifyStatus"))
+  {
+    pam_syslog(data->pamh, LOG_ERR, "Not the signal we expected (iface: %s, member: %s)",
+               sd_bus_message_get_interface(m),
+               sd_bus_message_get_member(m));
+    return 0;
+  }
+
+  if ((r = sd_bus_message_read(m, "sb", &result, &done)) < 0)
+  {
+    pam_syslog(data->pamh, LOG_ERR, "Failed to parse VerifyResult signal: %d", r);
+    data->verify_ret = PAM_AUTHINFO_UNAVAIL;
+    return 0;
+  }
+
+  if (!data->verify_started)
+  {
+    pam_syslog(data->pamh, LOG_ERR, "Unexpected VerifyResult '%s', %" PRIu64 " signal", result, done);
+    return 0;
+  }
+
+  if (opts->debug)
+    pam_syslog(data->pamh, LOG_DEBUG, "Verify result: %s (done: %d)", result, done ? 1 : 0);
+
+  value = verify_result_from_str(result);
+  if (done)
+  {
+    data->result = value;
+    return 0;
+  }
+
+  // For intermediate failures, just log to syslog instead of showing user messages
+  // to avoid blocking modal dialogs in polkit
+  if (!verify_result_is_retry(value))
+  {
+    data->result = VERIFY_RESULT_PROTOCOL_ERROR;
+    return 0;
+  }
+
+  data->retry_scans++;
+  if (opts->debug && (msg = verify_result_to_msg(value, data->is_swipe)))
+    pam_syslog(data->pamh, LOG_DEBUG, "Intermediate verify result: %s", msg);
+
+  return 0;
+}
+
+static int
+verify_finger_selected(sd_bus_message *m,
+                       void *userdata,
+                       sd_bus_error *ret_error)
+{
+  verify_data *data = userdata;
+  const char *finger_name = NULL;
+  Finger finger;
+
+  if (sd_bus_message_read_basic(m, 's', &finger_name) < 0)
+  {
+    pam_syslog(data->pamh, LOG_ERR, "Failed to parse VerifyFingerSelected signal: %d", errno);
+    data->verify_ret = PAM_AUTHINFO_UNAVAIL;
+    return 0;
+  }
+
+  if (!data->verify_started)
+  {
+    pam_syslog(data->pamh, LOG_ERR, "Unexpected VerifyFingerSelected %s signal", finger_name);
+    return 0;
+  }
+
+  finger = finger_from_str(finger_name);
+  if (finger == FINGER_UNKNOWN)
+  {
+    data->result = VERIFY_RESULT_PROTOCOL_ERROR;
+    return 0;
+  }
+  if (opts->debug)
+    pam_syslog(data->pamh, LOG_DEBUG, "verify_finger_selected %s",
+               data->finger_msgs[finger] ? data->finger_msgs[finger] : finger_name);
+  // send_info_msg (data->pamh, data->finger_msgs[finger]);
+  return 0;
+}
+
+static int
+read_property_string(sd_bus_message *m, sd_bus_error *error, pf_arena *arena, char **ret)
+{
+  const char *s;
+  char *n;
+  int r;
+
+  r = sd_bus_message_read(m, "v", "s", &s);
+  if (r < 0)
+    return sd_bus_error_set_errno(error, r);
+
+  n = pf_arena_strdup(arena, s);
+  if (!n)
+    return sd_bus_error_set_errno(error, -ENOMEM);
+
+  *ret = n;
+  return 0;
+}
+
+/* Fetch all the device properties we care about in one round-trip.
+ * Nothing is sent if props already describes dev, so the record can be
+ * reused by every do_verify() call of the same authentication.
+ * See also https://github.com/systemd/systemd/issues/14636 */
+static int
+get_device_properties(sd_bus *bus,
+                      pf_arena *arena,
+                      const char *dev,
+                      sd_bus_error *error,
+                      device_properties *props)
+{
+  pf_autoptr(sd_bus_message) reply = NULL;
+  const char *key;
+  int r;
+
+  if (str_equal(props->dev, dev))
+    return 0;
+
+  device_properties_clear(props);
+
+  r = call_method(bus,
+                  "net.reactivated.Fprint",
+                  dev,
+                  "org.freedesktop.DBus.Properties",
+                  "GetAll",
+                  error,
+                  &reply,
+                  "s",
+                  "net.reactivated.Fprint.Device");
+  if (r < 0)
+    return r;
+
+  r = sd_bus_message_enter_container(reply, 'a', "{sv}");
+  if (r < 0)
+    return sd_bus_error_set_errno(error, r);
+
+  while ((r = sd_bus_message_enter_container(reply, 'e', "sv")) > 0)
+  {
+    r = sd_bus_message_read_basic(reply, 's', &key);
+    if (r < 0)
+      return sd_bus_error_set_errno(error, r);
+
+    if (str_equal(key, "name"))
+    {
+      r = read_property_string(reply, error, arena, &props->name);
+    }
+    else if (str_equal(key, "scan-type"))
+    {
+      r = read_property_string(reply, error, arena, &props->scan_type);
+    }
+    else if (str_equal(key, "num-enroll-stages"))
+    {
+      r = sd_bus_message_read(reply, "v", "i", &props->num_enroll_stages);
+    }
+    else if (str_equal(key, "finger-present"))
+    {
+      int b;
+      r = sd_bus_message_read(reply, "v", "b", &b);
+      props->finger_present = b;
+    }
+    else if (str_equal(key, "finger-needed"))
+    {
+      int b;
+      r = sd_bus_message_read(reply, "v", "b", &b);
+      props->finger_needed = b;
+    }
+    else
+    {
+      r = sd_bus_message_skip(reply, "v");
+    }
+    if (r < 0)
+      return sd_bus_error_set_errno(error, r);
+
+    r = sd_bus_message_exit_container(reply);
+    if (r < 0)
+      return sd_bus_error_set_errno(error, r);
+  }
+  if (r < 0)
+    return sd_bus_error_set_errno(error, r);
+
+  sd_bus_message_exit_container(reply);
+
+  props->dev = pf_arena_strdup(arena, dev);
+  if (!props->dev)
+    return sd_bus_error_set_errno(error, -ENOMEM);
+
+  return 0;
+}
+
+static int
+verify_started_cb(sd_bus_message *m,
+                  void *userdata,
+                  sd_bus_error *ret_error)
+{
+  const sd_bus_error *error = sd_bus_message_get_error(m);
+  verify_data *data = userdata;
+  verify_data *primary = data->primary ? data->primary : data;
+
+  trace_end(&primary->trace, PHASE_VERIFY_START);
+
+  if (error)
+  {
+    if (sd_bus_error_has_name(error, "net.reactivated.Fprint.Error.NoEnrolledPrints"))
+    {
+      pam_syslog(data->pamh, LOG_DEBUG, "No prints enrolled");
+      enroll_cache_invalidate(data->username);
+      data->verify_ret = PAM_AUTHINFO_UNAVAIL;
+    }
+    else
+    {
+      data->verify_ret = PAM_AUTH_ERR;
+    }
+
+    if (opts->debug)
+      pam_syslog(data->pamh, LOG_DEBUG, "VerifyStart failed on %s: %s", data->dev, error->message);
+
+    verify_set_armed(primary);
+    return 1;
+  }
+
+  if (opts->debug)
+    pam_syslog(data->pamh, LOG_DEBUG, "VerifyStart completed successfully on %s", data->dev);
+
+  data->verify_started = true;
+  data->armed_at = now();
+  if (primary->trace.phase_start[PHASE_VERIFY_WAIT] == 0)
+    trace_begin(&primary->trace, PHASE_VERIFY_WAIT);
+  verify_set_armed(primary);
+
+  return 1;
+}
+
+/* Queue a call to a device method without waiting for, or even asking
+ * for, a reply. It only reaches fprintd once the bus is flushed, which
+ * close_bus() does. */
+static int
+call_device_method_no_reply(sd_bus *bus, const char *dev, const char *member)
+{
+  pf_autoptr(sd_bus_message) m = NULL;
+  int r;
+
+  r = sd_bus_message_new_method_call(bus,
+                                     &m,
+                                     "net.reactivated.Fprint",
+                                     dev,
+                                     "net.reactivated.Fprint.Device",
+                                     member);
+  if (r < 0)
+    return r;
+
+  r = sd_bus_message_set_expect_reply(m, false);
+  if (r < 0)
+    return r;
+
+  return sd_bus_send(bus, m, NULL);
+}
+
+/* Looks at every reader taking part in the current attempt. Returns true
+ * once one of them came up with a result, stored in *ret_winner, or once
+ * none of them can produce one any more. */
+static bool
+verify_race_done(verify_data **readers, size_t num_readers, verify_data **ret_winner)
+{
+  size_t live = 0;
+  size_t i;
+
+  *ret_winner = NULL;
+  for (i = 0; i < num_readers; i++)
+  {
+    verify_data *reader = readers[i];
+
+    if (reader->dropped || reader->verify_ret != PAM_INCOMPLETE)
+      continue;
+    if (reader->verify_started && reader->result != VERIFY_RESULT_NONE)
+    {
+      *ret_winner = reader;
+      return true;
+    }
+    live++;
+  }
+
+  return live == 0;
+}
+
+/* Where one verify attempt stands, see verify_wait_run() */
+typedef enum
+{
+  WAIT_PENDING,
+  WAIT_FINISHED, /* The race is over, or the deadline passed */
+  WAIT_ABORTED,  /* A key press, SIGINT or the password thread */
+} wait_state;
+
+/* Everything a verify attempt waits on goes through one event loop on
+ * this thread: the bus, the wake-up from the password thread, SIGINT,
+ * the terminal in "no-pthread" mode and the deadline. The password
+ * prompt itself cannot join it, conv() blocks for as long as the
+ * application likes, which is why it still gets a thread of its own. */
+typedef struct
+{
+  sd_event *event;
+  sd_event_source *timer;
+  sd_bus *bus;
+  verify_data *data;
+  verify_data **readers;
+  size_t num_readers;
+
+  wait_state state;
+  verify_data *winner;
+  unsigned iterations;
+} verify_wait;
+
+static void
+verify_wait_finish(verify_wait *w)
+{
+  if (w->bus && w->event)
+    sd_bus_detach_event(w->bus);
+  w->timer = sd_event_source_unref(w->timer);
+  w->event = sd_event_unref(w->event);
+}
+
+PF_DEFINE_AUTO_CLEAN_FUNC(verify_wait, verify_wait_finish);
+
+static void
+verify_wait_set(verify_wait *w, wait_state state)
+{
+  if (w->state == WAIT_PENDING)
+    w->state = state;
+}
+
+static int
+verify_wait_timeout(sd_event_source *s, uint64_t usec, void *userdata)
 {
-  const sd_bus_error *error = sd_bus_message_get_error(m);
-  verify_data *data = userdata;
+  verify_wait_set(userdata, WAIT_FINISHED);
+  return 0;
+}
 
-  if (error)
-  {
-    if (sd_bus_error_has_name(error, "net.reactivated.Fprint.Error.NoEnrolledPrints"))
-    {
-      pam_syslog(data->pamh, LOG_DEBUG, "No prints enrolled");
-      data->verify_ret = PAM_AUTHINFO_UNAVAIL;
-    }
-    else
-    {
-      data->verify_ret = PAM_AUTH_ERR;
-    }
+static int
+verify_wait_wakeup(sd_event_source *s, int fd, uint32_t revents, void *userdata)
+{
+  verify_wait *w = userdata;
 
-    if (debug)
-      pam_syslog(data->pamh, LOG_DEBUG, "VerifyStart failed: %s", error->message);
+  if (opts->debug)
+    pam_syslog(w->data->pamh, LOG_DEBUG, "Woken up by the password prompt: assuming pw recieved");
+  verify_wait_set(w, WAIT_ABORTED);
+  return 0;
+}
 
-    return 1;
-  }
+static int
+verify_wait_signal(sd_event_source *s, int fd, uint32_t revents, void *userdata)
+{
+  verify_wait *w = userdata;
+  struct signalfd_siginfo siginfo;
 
-  if (debug)
-    pam_syslog(data->pamh, LOG_DEBUG, "VerifyStart completed successfully");
+  if (read(fd, &siginfo, sizeof(siginfo)) <= 0)
+    return 0;
 
-  data->verify_started = true;
+  if (opts->debug)
+    pam_syslog(w->data->pamh, LOG_DEBUG, "Received signal %d during verify", siginfo.ssi_signo);
 
-  return 1;
+  /* The only way for this to happen is if we received SIGINT. */
+  verify_wait_set(w, WAIT_ABORTED);
+  return 0;
 }
 
-static void
-fd_cleanup(int *fd)
+static int
+verify_wait_key(sd_event_source *s, int fd, uint32_t revents, void *userdata)
 {
-  if (*fd >= 0)
-    close(*fd);
-}
+  verify_wait *w = userdata;
+  char c;
 
-typedef int fd_int;
-PF_DEFINE_AUTO_CLEAN_FUNC(fd_int, fd_cleanup);
+  if (read(fd, &c, 1) <= 0)
+    return 0;
 
-static pthread_mutex_t input_mutex = PTHREAD_MUTEX_INITIALIZER;
-static bool has_recieved_sigusr1 = false;
-static bool fingerprint_success = false;
-static bool fingerprint_finished = false;
+  if (opts->debug)
+    pam_syslog(w->data->pamh, LOG_DEBUG, "Key pressed during verify, stopping");
+  verify_wait_set(w, WAIT_ABORTED);
+  return 0;
+}
 
 static void
-handle_sigusr1(int sig)
+verify_wait_check(verify_wait *w)
 {
-  has_recieved_sigusr1 = true;
+  if (w->data->stop_got_pw || !sd_bus_is_open(w->bus) ||
+      verify_race_done(w->readers, w->num_readers, &w->winner))
+    verify_wait_set(w, WAIT_FINISHED);
 }
 
+/* Runs after every dispatch, bus messages included */
 static int
-do_verify(sd_bus *bus, verify_data *data)
+verify_wait_post(sd_event_source *s, void *userdata)
+{
+  verify_wait_check(userdata);
+  return 0;
+}
+
+static int
+verify_wait_init(verify_wait *w,
+                 sd_bus *bus,
+                 verify_data *data,
+                 verify_data **readers,
+                 size_t num_readers,
+                 int signal_fd,
+                 int term_fd)
 {
-  pf_autoptr(sd_bus_slot) verify_status_slot = NULL;
-  pf_autoptr(sd_bus_slot) verify_finger_selected_slot = NULL;
-  pf_autofree char *scan_type = NULL;
-  sigset_t signals;
-  fd_int signal_fd = -1;
   int r;
-  int term_fd = -1;
-  struct pollfd fds[2];
 
-  if (!no_pthread)
-    term_fd = -1;
-  else
-    term_fd = fileno(stdin);
+  w->data = data;
+  w->readers = readers;
+  w->num_readers = num_readers;
 
-  /* Get some properties for the device */
-  r = get_property_string(bus,
-                          "net.reactivated.Fprint",
-                          data->dev,
-                          "net.reactivated.Fprint.Device",
-                          "scan-type",
-                          NULL,
-                          &scan_type);
+  r = sd_event_new(&w->event);
+  if (r < 0)
+    return r;
+  r = sd_bus_attach_event(bus, w->event, SD_EVENT_PRIORITY_NORMAL);
   if (r < 0)
-    pam_syslog(data->pamh, LOG_ERR, "Failed to get scan-type for %s: %d", data->dev, r);
-  if (debug)
-    pam_syslog(data->pamh, LOG_DEBUG, "scan-type for %s: %s", data->dev, scan_type);
-  if (str_equal(scan_type, "swipe"))
-    data->is_swipe = true;
+    return r;
+  w->bus = bus;
+
+  if ((r = sd_event_add_post(w->event, NULL, verify_wait_post, w)) < 0 ||
+      (r = sd_event_add_time(w->event, &w->timer, CLOCK_MONOTONIC, 0, 1, verify_wait_timeout, w)) < 0 ||
+      (r = sd_event_source_set_enabled(w->timer, SD_EVENT_OFF)) < 0)
+    return r;
+
+  if (data->wakeup_fd >= 0 &&
+      (r = sd_event_add_io(w->event, NULL, data->wakeup_fd, EPOLLIN, verify_wait_wakeup, w)) < 0)
+    return r;
+  if (signal_fd >= 0 &&
+      (r = sd_event_add_io(w->event, NULL, signal_fd, EPOLLIN, verify_wait_signal, w)) < 0)
+    return r;
+
+  /* epoll refuses regular files, stdin may well be one */
+  if (term_fd >= 0 &&
+      sd_event_add_io(w->event, NULL, term_fd, EPOLLIN, verify_wait_key, w) < 0 &&
+      opts->debug)
+    pam_syslog(data->pamh, LOG_DEBUG, "Cannot watch the terminal for key presses");
 
-  if (data->has_multiple_devices)
+  return 0;
+}
+
+/* Dispatches events until the attempt is over, or until deadline on the
+ * CLOCK_MONOTONIC clock of now() passed. */
+static int
+verify_wait_run(verify_wait *w, uint64_t deadline)
+{
+  int r;
+
+  w->state = WAIT_PENDING;
+  w->winner = NULL;
+  w->iterations = 0;
+
+  if (deadline != ULONG_MAX)
   {
-    get_property_string(bus,
-                        "net.reactivated.Fprint",
-                        data->dev,
-                        "net.reactivated.Fprint.Device",
-                        "name",
-                        NULL,
-                        &data->driver);
+    if ((r = sd_event_source_set_time(w->timer, deadline)) < 0 ||
+        (r = sd_event_source_set_enabled(w->timer, SD_EVENT_ONESHOT)) < 0)
+      return r;
+  }
+  else
+  {
+    sd_event_source_set_enabled(w->timer, SD_EVENT_OFF);
+  }
+
+  verify_wait_check(w);
+  while (w->state == WAIT_PENDING)
+  {
+    w->iterations++;
+    r = sd_event_run(w->event, UINT64_MAX);
     if (r < 0)
-      pam_syslog(data->pamh, LOG_ERR, "Failed to get driver name for %s: %d", data->dev, r);
-    if (debug && r == 0)
-      pam_syslog(data->pamh, LOG_DEBUG, "driver name for %s: %s", data->dev, data->driver);
+      return r;
   }
 
-  sd_bus_match_signal(bus,
-                      &verify_status_slot,
-                      "net.reactivated.Fprint",
-                      data->dev,
-                      "net.reactivated.Fprint.Device",
-                      "VerifyStatus",
-                      verify_result,
-                      data);
+  return 0;
+}
 
-  sd_bus_match_signal(bus,
-                      &verify_finger_selected_slot,
-                      "net.reactivated.Fprint",
-                      data->dev,
-                      "net.reactivated.Fprint.Device",
-                      "VerifyFingerSelected",
-                      verify_finger_selected,
-                      data);
+static int
+verify_race(sd_bus *bus, verify_data *data, verify_data **readers, size_t num_readers)
+{
+  sigset_t signals;
+  pf_auto(fd_int) signal_fd = -1;
+  pf_auto(verify_wait) wait = {0};
+  int r;
+  int term_fd = -1;
+  unsigned attempts = 0;
+  size_t i;
+
+  if (!OPT_NO_PTHREAD)
+    term_fd = -1;
+  else
+    term_fd = fileno(stdin);
 
-  if (!no_pthread)
+  if (!OPT_NO_PTHREAD)
   {
     sigemptyset(&signals);
     sigaddset(&signals, SIGINT);
-    sigaddset(&signals, SIGUSR1);
     signal_fd = signalfd(signal_fd, &signals, SFD_NONBLOCK);
   }
 
+  r = verify_wait_init(&wait, bus, data, readers, num_readers, signal_fd, term_fd);
+  if (r < 0)
+  {
+    pam_syslog(data->pamh, LOG_ERR, "Failed to set up the event loop: %d", r);
+    return PAM_AUTHINFO_UNAVAIL;
+  }
+
   while (data->max_tries > 0)
   {
     uint64_t verification_end = ULONG_MAX;
+    uint64_t timeout_ms = 0;
+    verify_data *winner = NULL;
+    size_t num_started = 0;
 
-    if (timeout != UINT_MAX)
-      verification_end = now() + (timeout * USEC_PER_SEC);
+    /* Racing readers all get the deadline of the slowest one */
+    for (i = 0; i < num_readers; i++)
+    {
+      uint64_t deadline_ms = timing_deadline_ms(&readers[i]->timing);
 
-    data->timed_out = false;
-    data->verify_started = false;
-    data->verify_ret = PAM_INCOMPLETE;
+      if (!readers[i]->dropped && deadline_ms > timeout_ms)
+        timeout_ms = deadline_ms;
+    }
+    if (timeout_ms != UINT64_MAX)
+      verification_end = now() + timeout_ms * USEC_PER_MSEC;
+    if (opts->debug && opts->adaptive_timeout)
+      pam_syslog(data->pamh, LOG_DEBUG, "Attempt timeout: %" PRIu64 " ms", timeout_ms);
 
-    free(data->result);
-    data->result = NULL;
+    data->timed_out = false;
 
-    if (debug)
-      pam_syslog(data->pamh, LOG_DEBUG, "About to call VerifyStart");
+    if (call_budget_exhausted())
+    {
+      pam_syslog(data->pamh, LOG_WARNING, "Out of bus budget, giving up on the fingerprint");
+      return PAM_AUTHINFO_UNAVAIL;
+    }
 
-    r = sd_bus_call_method_async(bus,
-                                 NULL,
-                                 "net.reactivated.Fprint",
-                                 data->dev,
-                                 "net.reactivated.Fprint.Device",
-                                 "VerifyStart",
-                                 verify_started_cb,
-                                 data,
-                                 "s",
-                                 "any");
+    if (attempts++ > 0)
+      data->trace.retries++;
+    trace_begin(&data->trace, PHASE_VERIFY_START);
 
-    if (r < 0)
+    for (i = 0; i < num_readers; i++)
     {
-      if (debug)
-        pam_syslog(data->pamh, LOG_DEBUG, "VerifyStart call failed: %d", r);
-      break;
+      verify_data *reader = readers[i];
+
+      if (reader->dropped)
+        continue;
+
+      reader->verify_started = false;
+      reader->verify_ret = PAM_INCOMPLETE;
+      reader->result = VERIFY_RESULT_NONE;
+      reader->retry_scans = 0;
+      reader->armed_at = 0;
+
+      if (opts->debug)
+        pam_syslog(data->pamh, LOG_DEBUG, "About to call VerifyStart on %s", reader->dev);
+
+      reader->verify_start_slot = sd_bus_slot_unref(reader->verify_start_slot);
+      r = sd_bus_call_method_async(bus,
+                                   &reader->verify_start_slot,
+                                   "net.reactivated.Fprint",
+                                   reader->dev,
+                                   "net.reactivated.Fprint.Device",
+                                   "VerifyStart",
+                                   verify_started_cb,
+                                   reader,
+                                   "s",
+                                   "any");
+      if (r < 0)
+      {
+        if (opts->debug)
+          pam_syslog(data->pamh, LOG_DEBUG, "VerifyStart call failed: %d", r);
+        reader->dropped = true;
+        continue;
+      }
+      num_started++;
     }
+    if (num_started == 0)
+      break;
+
+    /* The readers are getting ready, show the previous attempt's result
+     * in the meantime */
+    flush_msgs(&data->msgs);
 
-    for (;;)
+    r = verify_wait_run(&wait, verification_end);
+    if (r < 0)
     {
-      struct signalfd_siginfo siginfo;
-      int64_t wait_time;
+      pam_syslog(data->pamh, LOG_ERR, "Error waiting for events: %d", r);
+      return PAM_AUTHINFO_UNAVAIL;
+    }
+    if (wait.state == WAIT_ABORTED)
+      return PAM_AUTHINFO_UNAVAIL;
+    winner = wait.winner;
 
-      wait_time = verification_end - now();
-      if (wait_time <= 0 || data->stop_got_pw)
-        break;
+    trace_end(&data->trace, PHASE_VERIFY_START);
+    trace_end(&data->trace, PHASE_VERIFY_WAIT);
+    if (opts->debug)
+      pam_syslog(data->pamh, LOG_DEBUG, "Verify attempt took %u event loop iterations", wait.iterations);
 
-      if (!no_pthread && read(signal_fd, &siginfo, sizeof(siginfo)) > 0)
+    /* Readers whose VerifyStart failed sit out the rest of the race, it
+     * is only over once all of them did. */
+    if (!winner && verify_race_done(readers, num_readers, &winner) && !winner)
+    {
+      for (i = 0; i < num_readers; i++)
       {
-        if (debug)
-          pam_syslog(data->pamh, LOG_DEBUG, "Received signal %d during verify", siginfo.ssi_signo);
-
-        /* The only way for this to happen is if we received SIGINT. */
-        return PAM_AUTHINFO_UNAVAIL;
+        if (!readers[i]->dropped && readers[i]->verify_ret != PAM_INCOMPLETE)
+          return readers[i]->verify_ret;
       }
+    }
+    for (i = 0; i < num_readers; i++)
+    {
+      if (readers[i]->dropped)
+        continue;
+      if (readers[i]->verify_ret != PAM_INCOMPLETE)
+        readers[i]->dropped = true;
 
-      r = sd_bus_process(bus, NULL);
-      if (r < 0)
+      switch (readers[i]->result)
+      {
+      case VERIFY_RESULT_MATCH:
+      case VERIFY_RESULT_NO_MATCH:
+        health_record_ok(readers[i]->reader_key);
         break;
-      if (data->verify_ret != PAM_INCOMPLETE)
+      case VERIFY_RESULT_UNKNOWN_ERROR:
+      case VERIFY_RESULT_DISCONNECTED:
+        health_record_failure(readers[i]->reader_key);
+        metrics_count_failure();
         break;
-      if (!data->verify_started)
-        continue;
-      if (data->result != NULL)
+      default:
         break;
-      if (r == 0)
-      {
-        int nfds = 1;
-        fds[0].fd = sd_bus_get_fd(bus);
-        fds[0].events = sd_bus_get_events(bus);
-        fds[0].revents = 0;
-        if (term_fd >= 0)
-        {
-          fds[1].fd = term_fd;
-          fds[1].events = POLLIN;
-          fds[1].revents = 0;
-          nfds = 2;
-        }
-
-        // if (debug)
-        //   {
-        //     pam_syslog (data->pamh, LOG_DEBUG,
-        //                 "Waiting for %" PRId64 " seconds (%" PRId64 " usecs)",
-        //                 wait_time / USEC_PER_SEC,
-        //                 wait_time);
-        //   }
-
-        r = poll(fds, nfds, wait_time / USEC_PER_MSEC);
-        if (r < 0 && errno != EINTR)
-        {
-          pam_syslog(data->pamh, LOG_ERR, "Error waiting for events: %d", errno);
-          return PAM_AUTHINFO_UNAVAIL;
-        }
-
-        // Check for keyboard input in no_pthread mode
-        if (no_pthread && term_fd >= 0 && (fds[1].revents & POLLIN))
-        {
-          char c;
-          if (read(term_fd, &c, 1) > 0)
-          {
-            if (debug)
-              pam_syslog(data->pamh, LOG_DEBUG, "Key pressed during verify, stopping");
-            return PAM_AUTHINFO_UNAVAIL;
-          }
-        }
-
-        if (has_recieved_sigusr1 && !no_pthread)
-        {
-          if (debug)
-            pam_syslog(data->pamh, LOG_DEBUG, "Got SIGUSR1: assuming pw recieved");
-          return PAM_AUTHINFO_UNAVAIL;
-        }
       }
     }
 
-    if (data->verify_ret != PAM_INCOMPLETE)
-      return data->verify_ret;
+    if (winner && winner != data)
+    {
+      if (opts->debug)
+        pam_syslog(data->pamh, LOG_DEBUG, "%s answered first", winner->dev);
+      data->result = winner->result;
+    }
 
-    if (now() >= verification_end && !no_need_enter && !no_pthread)
+    if (now() >= verification_end && !opts->no_need_enter && !OPT_NO_PTHREAD)
     {
       data->timed_out = true;
-      if (!suppress_messages)
-        send_err_msg(data->pamh, _("FP timeout"));
+      if (!OPT_SUPPRESS_MESSAGES)
+        queue_err_msg(&data->msgs, message_get(MSG_FP_TIMEOUT));
     }
     else
     {
-      if (str_equal(data->result, "verify-no-match"))
+      if (data->result == VERIFY_RESULT_NO_MATCH)
       {
-        if (debug)
+        if (opts->debug)
           pam_syslog(data->pamh, LOG_DEBUG, "FP no match, will retry");
-        if (!suppress_messages)
-          send_info_msg(data->pamh, _("FP no match, try again"));
+        if (!OPT_SUPPRESS_MESSAGES)
+          queue_info_msg(&data->msgs, message_get(MSG_FP_NO_MATCH));
       }
-      else if (str_equal(data->result, "verify-match"))
+      else if (data->result == VERIFY_RESULT_MATCH)
       {
-        if (!no_pthread)
+        verify_data *matched = winner ? winner : data;
+
+        data->trace.matched = now();
+        if (opts->adaptive_timeout && matched->armed_at != 0)
+          timing_record(matched->reader_key, &matched->timing,
+                        (now() - matched->armed_at) / USEC_PER_MSEC,
+                        matched->retry_scans);
+        if (!OPT_NO_PTHREAD)
         {
-          pthread_mutex_lock(&input_mutex);
-          fingerprint_success = true;
-          pthread_mutex_unlock(&input_mutex);
+          pthread_mutex_lock(&data->input_mutex);
+          data->fingerprint_success = true;
+          pthread_mutex_unlock(&data->input_mutex);
         }
         return PAM_SUCCESS;
       }
     }
 
-    /* Ignore errors from VerifyStop */
-    data->verify_started = false;
-    (void)sd_bus_call_method(bus,
-                             "net.reactivated.Fprint",
-                             data->dev,
-                             "net.reactivated.Fprint.Device",
-                             "VerifyStop",
-                             NULL,
-                             NULL,
-                             NULL,
-                             NULL);
+    /* Ignore errors from VerifyStop. Unless we are about to retry, the
+     * devices get released next, so there is no point waiting for them. */
+    trace_begin(&data->trace, PHASE_VERIFY_STOP);
+    for (i = 0; i < num_readers; i++)
+    {
+      verify_data *reader = readers[i];
+
+      if (reader->dropped)
+        continue;
+
+      reader->verify_started = false;
+      if ((opts->async_release || call_budget_exhausted()) &&
+          (data->timed_out || data->stop_got_pw || data->max_tries <= 1 ||
+           data->result != VERIFY_RESULT_NO_MATCH))
+        (void)call_device_method_no_reply(bus, reader->dev, "VerifyStop");
+      else
+        (void)call_method(bus,
+                          "net.reactivated.Fprint",
+                          reader->dev,
+                          "net.reactivated.Fprint.Device",
+                          "VerifyStop",
+                          NULL,
+                          NULL,
+                          NULL,
+                          NULL);
+    }
+    trace_end(&data->trace, PHASE_VERIFY_STOP);
 
     if (data->timed_out || data->stop_got_pw)
     {
@@ -649,22 +2367,17 @@ do_verify(sd_bus *bus, verify_data *data)
     }
     else
     {
-      if (str_equal(data->result, "verify-no-match"))
+      switch (data->result)
       {
+      case VERIFY_RESULT_NO_MATCH:
         /* Nothing to do at this point. */
-      }
-      else if (str_equal(data->result, "verify-unknown-error"))
-      {
-        return PAM_AUTHINFO_UNAVAIL;
-      }
-      else if (str_equal(data->result, "verify-disconnected"))
-      {
+        break;
+      case VERIFY_RESULT_UNKNOWN_ERROR:
+      case VERIFY_RESULT_DISCONNECTED:
         return PAM_AUTHINFO_UNAVAIL;
-      }
-      else
-      {
-        if (!suppress_messages)
-          send_err_msg(data->pamh, _("FP unknown error"));
+      default:
+        if (!OPT_SUPPRESS_MESSAGES)
+          queue_err_msg(&data->msgs, message_get(MSG_FP_UNKNOWN_ERROR));
         return PAM_AUTH_ERR;
       }
     }
@@ -677,95 +2390,275 @@ do_verify(sd_bus *bus, verify_data *data)
   return PAM_AUTH_ERR;
 }
 
-static size_t
-user_enrolled_prints_num(pam_handle_t *pamh,
-                         sd_bus *bus,
-                         const char *dev,
-                         const char *username)
+/* Verify on data->dev, and in "multi-device" mode on all of its peers at
+ * the same time. The first reader to come up with a result decides the
+ * attempt, the others are stopped. */
+static int
+do_verify(sd_bus *bus, verify_data *data)
+{
+  verify_data *readers[MAX_READERS];
+  sd_bus_slot *match_slots[2 * MAX_READERS] = {NULL};
+  size_t num_readers = 0;
+  size_t i;
+  int ret;
+  int r;
+
+  readers[num_readers++] = data;
+  for (i = 0; i < data->num_peers && num_readers < MAX_READERS; i++)
+    readers[num_readers++] = data->peers[i];
+
+  for (i = 0; i < num_readers; i++)
+  {
+    verify_data *reader = readers[i];
+
+    reader->dropped = false;
+
+    /* Get some properties for the device */
+    r = get_device_properties(bus, data->arena, reader->dev, NULL, &reader->props);
+    if (r < 0)
+      pam_syslog(data->pamh, LOG_ERR, "Failed to get properties for %s: %d", reader->dev, r);
+    if (opts->debug)
+      pam_syslog(data->pamh, LOG_DEBUG, "scan-type for %s: %s", reader->dev, reader->props.scan_type);
+    reader->is_swipe = str_equal(reader->props.scan_type, "swipe");
+    if (!reader_key(reader->reader_key, sizeof(reader->reader_key),
+                    reader->props.name, reader->props.scan_type))
+      reader->reader_key[0] = '\0';
+
+    if (opts->adaptive_timeout)
+      timing_load(reader->reader_key, &reader->timing);
+
+    if (reader->has_multiple_devices)
+    {
+      reader->driver = reader->props.name;
+      if (opts->debug && reader->driver)
+        pam_syslog(data->pamh, LOG_DEBUG, "driver name for %s: %s", reader->dev, reader->driver);
+    }
+
+    /* Format these up front rather than in the signal handler. They
+     * are only ever logged, so don't bother unless debugging. */
+    if (opts->debug && !reader->finger_msgs[FINGER_ANY])
+    {
+      Finger finger;
+      char msg[256];
+
+      for (finger = FINGER_ANY; finger < FINGER_UNKNOWN; finger++)
+      {
+        if (finger_format_msg(finger, reader->driver, reader->is_swipe, msg, sizeof(msg)))
+          reader->finger_msgs[finger] = pf_arena_strdup(data->arena, msg);
+      }
+    }
+
+    sd_bus_match_signal(bus,
+                        &match_slots[2 * i],
+                        "net.reactivated.Fprint",
+                        reader->dev,
+                        "net.reactivated.Fprint.Device",
+                        "VerifyStatus",
+                        verify_result,
+                        reader);
+
+    sd_bus_match_signal(bus,
+                        &match_slots[2 * i + 1],
+                        "net.reactivated.Fprint",
+                        reader->dev,
+                        "net.reactivated.Fprint.Device",
+                        "VerifyFingerSelected",
+                        verify_finger_selected,
+                        reader);
+  }
+
+  ret = verify_race(bus, data, readers, num_readers);
+
+  /* A reply still on its way must not be dispatched once the bus is
+   * parked, the readers are freed with the auth data. */
+  for (i = 0; i < num_readers; i++)
+    readers[i]->verify_start_slot = sd_bus_slot_unref(readers[i]->verify_start_slot);
+  for (i = 0; i < 2 * num_readers; i++)
+    sd_bus_slot_unref(match_slots[i]);
+
+  return ret;
+}
+
+static void
+release_device(pam_handle_t *pamh,
+               sd_bus *bus,
+               const char *dev,
+               auth_trace *trace)
 {
   pf_auto(sd_bus_error) error = SD_BUS_ERROR_NULL;
-  pf_autoptr(sd_bus_message) m = NULL;
-  size_t num_fingers = 0;
-  const char *s;
   int r;
 
-  r = sd_bus_call_method(bus,
-                         "net.reactivated.Fprint",
-                         dev,
-                         "net.reactivated.Fprint.Device",
-                         "ListEnrolledFingers",
-                         &error,
-                         &m,
-                         "s",
-                         username);
-  if (r < 0)
+  trace_begin(trace, PHASE_RELEASE);
+  if (opts->async_release || call_budget_exhausted())
   {
-    /* If ListEnrolledFingers fails then verification should
-     * also fail (both use the same underlying call), so we
-     * report false here and bail out early.  */
-    if (debug)
-      pam_syslog(pamh, LOG_DEBUG, "ListEnrolledFingers failed for %s: %s",
-                 username, error.message);
-    return 0;
+    r = call_device_method_no_reply(bus, dev, "Release");
+    if (r < 0)
+      pam_syslog(pamh, LOG_ERR, "ReleaseDevice failed: %d", r);
+  }
+  else if (call_method(bus,
+                       "net.reactivated.Fprint",
+                       dev,
+                       "net.reactivated.Fprint.Device",
+                       "Release",
+                       &error,
+                       NULL,
+                       NULL,
+                       NULL) < 0)
+  {
+    pam_syslog(pamh, LOG_ERR, "ReleaseDevice failed: %s", error.message);
   }
+  trace_end(trace, PHASE_RELEASE);
+}
 
-  r = sd_bus_message_enter_container(m, 'a', "s");
+static void
+close_bus(pam_handle_t *pamh, sd_bus *bus)
+{
+  uint64_t flush_end;
+  uint64_t queued;
+
+  /* Give the calls queued by call_device_method_no_reply() a bounded
+   * amount of time to be written out, fprintd handles them after we
+   * are gone. */
+  flush_end = now() + RELEASE_FLUSH_TIMEOUT_MS * USEC_PER_MSEC;
+  while (sd_bus_get_n_queued_write(bus, &queued) >= 0 && queued > 0)
+  {
+    int64_t wait_time = flush_end - now();
+
+    if (wait_time <= 0)
+    {
+      pam_syslog(pamh, LOG_WARNING, "Gave up flushing %" PRIu64 " messages to fprintd", queued);
+      break;
+    }
+    if (sd_bus_process(bus, NULL) < 0)
+      break;
+    if (sd_bus_wait(bus, wait_time) < 0)
+      break;
+  }
+
+  sd_bus_close(bus);
+}
+
+static bool
+claim_device(pam_handle_t *pamh,
+             sd_bus *bus,
+             const char *dev,
+             const char *username,
+             auth_trace *trace)
+{
+  pf_auto(sd_bus_error) error = SD_BUS_ERROR_NULL;
+  int r;
+
+  trace_begin(trace, PHASE_CLAIM);
+  r = call_method(bus,
+                  "net.reactivated.Fprint",
+                  dev,
+                  "net.reactivated.Fprint.Device",
+                  "Claim",
+                  &error,
+                  NULL,
+                  "s",
+                  username);
+  trace_end(trace, PHASE_CLAIM);
   if (r < 0)
   {
-    pam_syslog(pamh, LOG_ERR, "Failed to parse answer from ListEnrolledFingers(): %d", r);
-    return 0;
+    if (opts->debug)
+      pam_syslog(pamh, LOG_DEBUG, "failed to claim device %s", error.message);
+    enroll_cache_invalidate(username);
+    return false;
   }
 
-  while (sd_bus_message_read_basic(m, 's', &s) > 0)
-    num_fingers++;
-  sd_bus_message_exit_container(m);
+  return true;
+}
+
+/* Claim the readers discovery handed out next to data->dev, and give
+ * each one that could be claimed a verify_data of its own. */
+static void
+claim_peers(pam_handle_t *pamh,
+            sd_bus *bus,
+            verify_data *data,
+            const char *username,
+            char **peer_devs)
+{
+  size_t i;
+
+  data->peers = pf_arena_alloc(data->arena, (MAX_READERS - 1) * sizeof(verify_data *));
+  if (!data->peers)
+    return;
+
+  for (i = 0; i < MAX_READERS - 1 && peer_devs[i]; i++)
+  {
+    verify_data *peer;
+
+    if (!claim_device(pamh, bus, peer_devs[i], username, &data->trace))
+      continue;
 
-  return num_fingers;
+    peer = pf_arena_alloc(data->arena, sizeof(verify_data));
+    if (peer)
+      peer->dev = pf_arena_strdup(data->arena, peer_devs[i]);
+    if (!peer || !peer->dev)
+    {
+      release_device(pamh, bus, peer_devs[i], &data->trace);
+      continue;
+    }
+    peer->arena = data->arena;
+    peer->has_multiple_devices = true;
+    peer->pamh = pamh;
+    peer->username = username;
+    peer->wakeup_fd = -1;
+    pthread_mutex_init(&peer->input_mutex, NULL);
+    pthread_cond_init(&peer->armed_cond, NULL);
+    peer->primary = data;
+
+    if (opts->debug)
+      pam_syslog(pamh, LOG_DEBUG, "Also verifying on %s", peer->dev);
+    data->peers[data->num_peers++] = peer;
+  }
+  data->has_multiple_devices = data->has_multiple_devices || data->num_peers > 0;
 }
 
 static void
-release_device(pam_handle_t *pamh,
-               sd_bus *bus,
-               const char *dev)
+release_peers(pam_handle_t *pamh, sd_bus *bus, verify_data *data)
 {
-  pf_auto(sd_bus_error) error = SD_BUS_ERROR_NULL;
+  size_t i;
 
-  if (sd_bus_call_method(bus,
-                         "net.reactivated.Fprint",
-                         dev,
-                         "net.reactivated.Fprint.Device",
-                         "Release",
-                         &error,
-                         NULL,
-                         NULL,
-                         NULL) < 0)
-    pam_syslog(pamh, LOG_ERR, "ReleaseDevice failed: %s", error.message);
+  for (i = 0; i < data->num_peers; i++)
+  {
+    release_device(pamh, bus, data->peers[i]->dev, &data->trace);
+    verify_data_destroy(data->peers[i]);
+  }
+  data->peers = NULL;
+  data->num_peers = 0;
 }
 
+/* Open and claim the device to verify on, and its peers in "multi-device"
+ * mode. Returns whether data->dev was claimed. */
 static bool
-claim_device(pam_handle_t *pamh,
-             sd_bus *bus,
-             const char *dev,
-             const char *username)
+open_and_claim(pam_handle_t *pamh,
+               sd_bus *bus,
+               verify_data *data,
+               const char *username)
 {
-  pf_auto(sd_bus_error) error = SD_BUS_ERROR_NULL;
+  char *peer_devs[MAX_READERS] = {NULL};
+  pf_autofree char *dev = NULL;
+  bool claimed;
 
-  if (sd_bus_call_method(bus,
-                         "net.reactivated.Fprint",
-                         dev,
-                         "net.reactivated.Fprint.Device",
-                         "Claim",
-                         &error,
-                         NULL,
-                         "s",
-                         username) < 0)
-  {
-    if (debug)
-      pam_syslog(pamh, LOG_DEBUG, "failed to claim device %s", error.message);
+  dev = open_device(pamh, bus, username, &data->has_multiple_devices,
+                    opts->multi_device ? peer_devs : NULL, &data->trace);
+  if (!dev)
+    return false;
+  data->dev = pf_arena_strdup(data->arena, dev);
+  if (!data->dev)
+  {
+    peer_devs_free(peer_devs);
     return false;
   }
 
-  return true;
+  claimed = claim_device(pamh, bus, data->dev, username, &data->trace);
+  if (claimed && opts->multi_device && peer_devs[0])
+    claim_peers(pamh, bus, data, username, peer_devs);
+  peer_devs_free(peer_devs);
+
+  return claimed;
 }
 
 static int
@@ -777,6 +2670,7 @@ name_owner_changed(sd_bus_message *m,
   const char *name = NULL;
   const char *old_owner = NULL;
   const char *new_owner = NULL;
+  size_t i;
 
   if (sd_bus_message_read(m, "sss", &name, &old_owner, &new_owner) < 0)
   {
@@ -791,10 +2685,19 @@ name_owner_changed(sd_bus_message *m,
   /* Name owner for fprintd changed, give up as we might start listening
    * to events from a new name owner otherwise. */
   data->verify_ret = PAM_AUTHINFO_UNAVAIL;
+  metrics_count_failure();
+  if (data->verify_started)
+    health_record_failure(data->reader_key);
+  for (i = 0; i < data->num_peers; i++)
+  {
+    data->peers[i]->verify_ret = PAM_AUTHINFO_UNAVAIL;
+    if (data->peers[i]->verify_started)
+      health_record_failure(data->peers[i]->reader_key);
+  }
 
   pam_syslog(data->pamh, LOG_WARNING, "fprintd name owner changed during operation!");
 
-  if (debug)
+  if (opts->debug)
     pam_syslog(data->pamh, LOG_DEBUG, "Old owner: %s, New owner: %s", old_owner ? old_owner : "-", new_owner ? new_owner : "-");
 
   return 0;
@@ -827,77 +2730,90 @@ static void *
 prompt_pw(void *d)
 {
   verify_data *data = d;
-  char *pw = NULL;
+  pf_autosecret char *pw = NULL;
+  char *resp = NULL;
   int pam_result;
   const char *prompt_text;
 
-  if (debug)
-    pam_syslog(data->pamh, LOG_DEBUG, "Prompting for password");
+  opts = data->opts;
 
-  usleep(100000);
+  if (opts->debug)
+    pam_syslog(data->pamh, LOG_DEBUG, "Prompting for password");
 
-  pthread_mutex_lock(&input_mutex);
-  if (fingerprint_success)
+  pthread_mutex_lock(&data->input_mutex);
+  if (data->fingerprint_enabled)
   {
-    pthread_mutex_unlock(&input_mutex);
-    if (debug)
+    /* Give the reader a chance to go live before we prompt, so that
+     * "or scan fingerprint" is true by the time the user reads it. */
+    struct timespec armed_deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &armed_deadline);
+    armed_deadline.tv_nsec += PROMPT_ARM_TIMEOUT_MS * USEC_PER_MSEC * NSEC_PER_USEC;
+    armed_deadline.tv_sec += armed_deadline.tv_nsec / (USEC_PER_SEC * NSEC_PER_USEC);
+    armed_deadline.tv_nsec %= USEC_PER_SEC * NSEC_PER_USEC;
+
+    while (!data->verify_armed &&
+           pthread_cond_timedwait(&data->armed_cond, &data->input_mutex, &armed_deadline) == 0)
+      ;
+  }
+  if (data->fingerprint_success)
+  {
+    pthread_mutex_unlock(&data->input_mutex);
+    if (opts->debug)
       pam_syslog(data->pamh, LOG_DEBUG, "Fingerprint already succeeded, skipping password prompt");
     return NULL;
   }
-  pthread_mutex_unlock(&input_mutex);
+  pthread_mutex_unlock(&data->input_mutex);
 
   // Set prompt text based on whether fingerprint is available
   if (data->fingerprint_enabled)
   {
     prompt_text = "Enter password (or scan fingerprint): ";
-    if (debug)
+    if (opts->debug)
       pam_syslog(data->pamh, LOG_DEBUG, "Using fingerprint-enabled prompt");
   }
   else
   {
     prompt_text = "Enter password: ";
-    if (debug)
+    if (opts->debug)
       pam_syslog(data->pamh, LOG_DEBUG, "Using password-only prompt");
   }
 
   // Use pam_prompt to get the password
-  pam_result = pam_prompt(data->pamh, PAM_PROMPT_ECHO_OFF, &pw, "%s", prompt_text);
+  trace_prompt(&data->trace);
+  pam_result = pam_prompt(data->pamh, PAM_PROMPT_ECHO_OFF, &resp, "%s", prompt_text);
+  pw = secret_take(&resp);
   data->pam_prompt_result = pam_result;
 
-  if (debug)
+  if (opts->debug)
     pam_syslog(data->pamh, LOG_DEBUG, "Pam prompt returned: %d", pam_result);
 
   // Check if we were interrupted or got NULL
   if (pam_result != PAM_SUCCESS || pw == NULL)
   {
-    if (debug)
+    if (opts->debug)
       pam_syslog(data->pamh, LOG_DEBUG, "No password received - likely fingerprint succeeded or error");
-    pthread_mutex_lock(&input_mutex);
-    if (fingerprint_finished)
+    pthread_mutex_lock(&data->input_mutex);
+    if (data->fingerprint_finished)
     {
-      pthread_mutex_unlock(&input_mutex);
+      pthread_mutex_unlock(&data->input_mutex);
       return NULL;
     }
-    pthread_mutex_unlock(&input_mutex);
+    pthread_mutex_unlock(&data->input_mutex);
     // error while using password, let parent thread know
     data->stop_got_pw = true;
-    kill(data->ppid, SIGUSR1);
+    wakeup_verify(data);
     return NULL;
   }
 
   // Check again if fingerprint succeeded while we were waiting
-  pthread_mutex_lock(&input_mutex);
-  if (fingerprint_success)
+  pthread_mutex_lock(&data->input_mutex);
+  if (data->fingerprint_success)
   {
-    pthread_mutex_unlock(&input_mutex);
-    if (pw)
-    {
-      memset(pw, 0, strlen(pw));
-      free(pw);
-    }
+    pthread_mutex_unlock(&data->input_mutex);
     return NULL;
   }
-  pthread_mutex_unlock(&input_mutex);
+  pthread_mutex_unlock(&data->input_mutex);
 
   // Process the password if received
   if (pw && *pw)
@@ -906,28 +2822,223 @@ prompt_pw(void *d)
   }
 
   data->stop_got_pw = true;
-  if (debug)
+  if (opts->debug)
     pam_syslog(data->pamh, LOG_DEBUG, "PW prompt done, setting stop_got_pw=true");
 
-  // Signal to parent thread
-  kill(data->ppid, SIGUSR1);
+  // Wake up the verify loop in the parent thread
+  wakeup_verify(data);
+
+  return NULL;
+}
+
+/* eventfds have no file type of their own, only their /proc link tells */
+static bool
+fd_is_eventfd_or_fifo(int fd)
+{
+  char proc_path[64];
+  char target[32];
+  struct stat st;
+  ssize_t len;
+
+  if (fstat(fd, &st) < 0)
+    return false;
+  if (S_ISFIFO(st.st_mode))
+    return true;
+
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+  len = readlink(proc_path, target, sizeof(target) - 1);
+  if (len < 0)
+    return false;
+  target[len] = '\0';
+
+  return str_equal(target, "anon_inode:[eventfd]");
+}
+
+/* Applications that can abort a pending conversation hand us a file
+ * descriptor, an eventfd or the write end of a pipe, in
+ * PAM_FPRINTD_GROSSHACK_ABORT_FD. Writing to it tells them to end the
+ * password prompt, their conv() then fails and the prompt thread exits
+ * on its own, without the user pressing ENTER and without
+ * pthread_cancel(). Returns -1 if there is no usable one. */
+static int
+prompt_abort_fd(pam_handle_t *pamh)
+{
+  const char *value = pam_getenv(pamh, PROMPT_ABORT_FD_ENV);
+  char *end = NULL;
+  long fd;
+  int flags;
+
+  if (!value || *value == '\0')
+    return -1;
+
+  errno = 0;
+  fd = strtol(value, &end, 10);
+  if (errno != 0 || *end != '\0' || fd < 0 || fd > INT_MAX)
+    return -1;
+
+  flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || (flags & O_ACCMODE) == O_RDONLY)
+  {
+    pam_syslog(pamh, LOG_WARNING, "Ignoring %s=%s, not a writable file descriptor", PROMPT_ABORT_FD_ENV, value);
+    return -1;
+  }
+
+  /* Writing 8 bytes to anything else, a file or a socket the
+   * application uses for something unrelated, could corrupt it */
+  if (!fd_is_eventfd_or_fifo(fd))
+  {
+    if (opts->debug)
+      pam_syslog(pamh, LOG_DEBUG, "Ignoring %s=%s, not an eventfd or a pipe", PROMPT_ABORT_FD_ENV, value);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Asks the application to end the prompt and waits for the prompt
+ * thread to return. Returns false if it did not in time, the thread is
+ * then still running. */
+static bool
+prompt_abort(pam_handle_t *pamh, int fd, pthread_t thread)
+{
+  const uint64_t one = 1;
+  struct timespec deadline;
+  ssize_t r;
+
+  /* A full eventfd counter or pipe is just as readable */
+  r = write(fd, &one, sizeof(one));
+  if (r < 0 && errno != EAGAIN)
+  {
+    if (opts->debug)
+      pam_syslog(pamh, LOG_DEBUG, "Failed to signal the abort fd: %m");
+    return false;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += PROMPT_ABORT_GRACE_MS * USEC_PER_MSEC * NSEC_PER_USEC;
+  deadline.tv_sec += deadline.tv_nsec / (USEC_PER_SEC * NSEC_PER_USEC);
+  deadline.tv_nsec %= USEC_PER_SEC * NSEC_PER_USEC;
+
+  if (pthread_timedjoin_np(thread, NULL, &deadline) != 0)
+  {
+    if (opts->debug)
+      pam_syslog(pamh, LOG_DEBUG, "Application did not end the prompt, falling back");
+    return false;
+  }
+
+  return true;
+}
+
+/* Throw away pending terminal input, then wait for the debounce window
+ * to pass without any new keystroke. Returns false if one arrives, as
+ * that means the user is typing rather than releasing a key. */
+static bool
+wait_terminal_quiet(int term_fd, unsigned debounce_ms)
+{
+  struct pollfd flush_fd = {term_fd, POLLIN, 0};
+  char c;
+  int r;
 
-  // Clean up memory
-  if (pw)
+  while (poll(&flush_fd, 1, 0) > 0 && (flush_fd.revents & POLLIN))
   {
-    memset(pw, 0, strlen(pw)); // Clear password from memory
-    free(pw);
+    if (read(term_fd, &c, 1) <= 0)
+      break;
   }
+
+  if (debounce_ms == 0)
+    return true;
+
+  do
+    r = poll(&flush_fd, 1, debounce_ms);
+  while (r < 0 && errno == EINTR);
+
+  if (r > 0 && (flush_fd.revents & POLLIN))
+    return read(term_fd, &c, 1) <= 0;
+
+  return true;
+}
+
+typedef struct
+{
+  pam_handle_t *pamh;
+  sd_bus *bus;
+  const char *username;
+  verify_data *data;
+  pthread_t thread;
+  bool started;
+  bool claimed;
+} prewarm_job;
+
+/* Runs discovery and Claim while the calling thread sits in the
+ * password prompt. It owns the bus until prewarm_finish() joins it,
+ * and never touches the PAM conversation. */
+static void *
+prewarm_device(void *d)
+{
+  prewarm_job *job = d;
+  verify_data *data = job->data;
+
+  opts = data->opts;
+  if (opts->bus_budget_ms > 0)
+    call_budget = &data->call_budget;
+
+  job->claimed = open_and_claim(job->pamh, job->bus, data, job->username);
+
+  if (opts->debug)
+    pam_syslog(job->pamh, LOG_DEBUG, "Pre-warm done: device %s, %sclaimed",
+               data->dev ? data->dev : "-", job->claimed ? "" : "not ");
+
   return NULL;
 }
 
+static void
+prewarm_start(prewarm_job *job)
+{
+  job->claimed = false;
+  job->started = pthread_create(&job->thread, NULL, prewarm_device, job) == 0;
+  if (!job->started)
+    pam_syslog(job->pamh, LOG_ERR, "Failed to create pre-warm thread: %s", strerror(errno));
+}
+
+/* Returns whether the device was claimed, dropping the claim if the
+ * user went for a password after all. */
+static bool
+prewarm_finish(prewarm_job *job, bool keep)
+{
+  if (!job->started)
+    return false;
+
+  pthread_join(job->thread, NULL);
+  job->started = false;
+
+  if (job->claimed && !keep)
+  {
+    if (opts->debug)
+      pam_syslog(job->pamh, LOG_DEBUG, "Dropping pre-warmed claim on %s", job->data->dev);
+    release_device(job->pamh, job->bus, job->data->dev, &job->data->trace);
+    release_peers(job->pamh, job->bus, job->data);
+    job->claimed = false;
+  }
+  if (!job->claimed)
+  {
+    job->data->dev = NULL;
+  }
+
+  return job->claimed;
+}
+
 static int do_auth_no_pthread(pam_handle_t *pamh, const char *username, sd_bus *bus, verify_data *data)
 {
   int ret = PAM_AUTHINFO_UNAVAIL;
-  bool in_pw_mode = pw_first;
+  bool in_pw_mode = opts->pw_first;
   bool device_claimed = false;
-  data->fingerprint_enabled = true; // assume we can still use fingerprint
-  char *pw = NULL;
+  bool prewarmed = false;
+  prewarm_job prewarm = {
+      .pamh = pamh,
+      .bus = bus,
+      .username = username,
+      .data = data,
+  };
   struct termios term_attr;
   struct termios term_attr_old;
   int term_fd;
@@ -946,19 +3057,33 @@ static int do_auth_no_pthread(pam_handle_t *pamh, const char *username, sd_bus *
   {
     if (in_pw_mode)
     {
+      pf_autosecret char *pw = NULL;
+      char *resp = NULL;
+
       // Password mode
-      if (debug)
+      if (opts->debug)
         pam_syslog(pamh, LOG_DEBUG, "In password mode");
 
       // Restore normal terminal mode
       if (term_fd >= 0)
         tcsetattr(term_fd, TCSANOW, &term_attr_old);
 
+      // Speculatively get the reader ready while the user is typing
+      if (opts->prewarm_enabled && !prewarmed && data->fingerprint_enabled && !device_claimed)
+      {
+        prewarmed = true;
+        prewarm_start(&prewarm);
+      }
+
       // Get password
-      ret = pam_prompt(pamh, PAM_PROMPT_ECHO_OFF, &pw, data->fingerprint_enabled ? "Enter password (empty to switch to fingerprint): " : "Enter password: ");
+      flush_msgs(&data->msgs);
+      trace_prompt(&data->trace);
+      ret = pam_prompt(pamh, PAM_PROMPT_ECHO_OFF, &resp, data->fingerprint_enabled ? "Enter password (empty to switch to fingerprint): " : "Enter password: ");
+      pw = secret_take(&resp);
 
       if (ret != PAM_SUCCESS)
       {
+        prewarm_finish(&prewarm, false);
         return PAM_AUTH_ERR;
       }
 
@@ -968,43 +3093,38 @@ static int do_auth_no_pthread(pam_handle_t *pamh, const char *username, sd_bus *
         if (data->fingerprint_enabled)
         {
           in_pw_mode = false;
-          if (pw)
-          {
-            memset(pw, 0, strlen(pw));
-            free(pw);
-            pw = NULL;
-          }
           continue;
         }
         else
         {
           // No fingerprint device, treat as auth failure
-          if (pw)
-          {
-            memset(pw, 0, strlen(pw));
-            free(pw);
-          }
           return PAM_AUTH_ERR;
         }
       }
 
       // Process password
+      prewarm_finish(&prewarm, false);
+      data->stop_got_pw = true;
       pam_set_item(pamh, PAM_AUTHTOK, pw);
-      memset(pw, 0, strlen(pw));
-      free(pw);
       return PAM_AUTHINFO_UNAVAIL; // Let other modules handle password
     }
     else
     {
       pf_autoptr(sd_bus_slot) name_owner_changed_slot = NULL;
       // Fingerprint mode
-      if (data->fingerprint_enabled && !device_claimed)
+      if (data->fingerprint_enabled && !device_claimed && prewarm.started)
+      {
+        device_claimed = prewarm_finish(&prewarm, true);
+        data->fingerprint_enabled = device_claimed;
+        pam_syslog(pamh, LOG_DEBUG, "Using pre-warmed fingerprint device: %s", device_claimed ? "claimed" : "none");
+      }
+      else if (data->fingerprint_enabled && !device_claimed)
       {
         pam_syslog(pamh, LOG_DEBUG, "Openning fingerprint device");
-        data->dev = open_device(pamh, bus, username, &data->has_multiple_devices);
+        device_claimed = open_and_claim(pamh, bus, data, username);
         if (data->dev == NULL)
         {
-          if (debug)
+          if (opts->debug)
             pam_syslog(pamh, LOG_DEBUG, "No device found, falling back to password");
           // Continue to password prompt even with no device
           data->fingerprint_enabled = false;
@@ -1012,167 +3132,549 @@ static int do_auth_no_pthread(pam_handle_t *pamh, const char *username, sd_bus *
         }
         else
         {
-          device_claimed = claim_device(pamh, bus, data->dev, username);
           data->fingerprint_enabled = device_claimed;
           pam_syslog(pamh, LOG_DEBUG, "Claimed fingerprint device");
         }
       }
 
-      if (!device_claimed)
-      {
-        in_pw_mode = true;
-        continue;
-      }
+      if (!device_claimed)
+      {
+        in_pw_mode = true;
+        continue;
+      }
+
+      connect_name_owner_changed(bus, data, &name_owner_changed_slot);
+
+      if (opts->debug)
+        pam_syslog(pamh, LOG_DEBUG, "In fingerprint mode");
+
+      // Set terminal to raw mode to detect keypress
+      if (term_fd >= 0)
+        tcsetattr(term_fd, TCSANOW, &term_attr);
+
+      trace_prompt(&data->trace);
+      if (!OPT_SUPPRESS_MESSAGES)
+        queue_info_msg(&data->msgs, message_get(MSG_SCAN_OR_PRESS_KEY));
+      flush_msgs(&data->msgs);
+
+      // wait all keys released before running verify
+      if (term_fd >= 0 && !wait_terminal_quiet(term_fd, opts->key_debounce_ms))
+      {
+        // If we got more input, switch to password mode
+        pam_syslog(pamh, LOG_DEBUG, "Releasing fingerprint device");
+        release_device(pamh, bus, data->dev, &data->trace);
+        release_peers(pamh, bus, data);
+        data->dev = NULL;
+        device_claimed = false;
+        in_pw_mode = true;
+        if (opts->debug)
+          pam_syslog(pamh, LOG_DEBUG, "Key detected while flushing, switching to password mode");
+        continue;
+      }
+
+      ret = do_verify(bus, data);
+
+      disconnect_name_owner_changed(bus, &name_owner_changed_slot);
+
+      pam_syslog(pamh, LOG_DEBUG, "Fprint returned %d", ret);
+
+      if (ret == PAM_SUCCESS)
+      {
+        if (term_fd >= 0)
+          tcsetattr(term_fd, TCSANOW, &term_attr_old);
+        if (!opts->no_need_enter && !OPT_SUPPRESS_MESSAGES)
+        {
+          queue_info_msg(&data->msgs, message_get(MSG_FP_OK_PRESS_ENTER));
+        }
+        if (!opts->no_need_enter)
+        {
+          const char *dummy_pw = "";
+          pam_set_item(pamh, PAM_AUTHTOK, dummy_pw);
+        }
+        return ret;
+      }
+      else
+      {
+        if (device_claimed)
+        {
+          pam_syslog(pamh, LOG_DEBUG, "Releasing fingerprint device");
+          release_device(pamh, bus, data->dev, &data->trace);
+          release_peers(pamh, bus, data);
+          data->dev = NULL;
+          device_claimed = false;
+        }
+        if (opts->max_tries_switch_to_pw && ret == PAM_MAXTRIES)
+        {
+          in_pw_mode = true;
+          data->max_tries = opts->max_tries;
+          if (opts->debug)
+            pam_syslog(pamh, LOG_DEBUG, "Max tries reached, switching to password mode");
+          continue;
+        }
+        if (ret == PAM_AUTHINFO_UNAVAIL)
+        {
+          // This means either a key was pressed or verification was interrupted
+          in_pw_mode = true;
+          if (opts->debug)
+            pam_syslog(pamh, LOG_DEBUG, "Switching to password mode due to key press or interruption");
+          continue;
+        }
+      }
+
+      // If we reach here, verification failed with an error
+      if (term_fd >= 0)
+        tcsetattr(term_fd, TCSANOW, &term_attr_old);
+      return ret;
+    }
+  }
+
+  return PAM_AUTHINFO_UNAVAIL;
+}
+
+static auth_outcome_kind
+auth_outcome(const verify_data *data, int ret)
+{
+  if (data->stop_got_pw)
+    return OUTCOME_PASSWORD;
+  if (ret == PAM_SUCCESS)
+    return OUTCOME_FINGERPRINT;
+  if (ret == PAM_MAXTRIES)
+    return OUTCOME_MAX_TRIES;
+  if (data->timed_out)
+    return OUTCOME_TIMEOUT;
+  if (!data->fingerprint_enabled)
+    return OUTCOME_NO_DEVICE;
+  return OUTCOME_ERROR;
+}
+
+#define TRACE_FIXED_FIELDS 10
+
+/* Log one structured journal record with the timings of the whole
+ * authentication, e.g. "journalctl PAM_FPRINTD_OUTCOME=timeout" */
+static void
+emit_trace(pam_handle_t *pamh, const verify_data *data, int ret)
+{
+  char fields[TRACE_FIXED_FIELDS + PHASE_COUNT][64];
+  struct iovec iov[TRACE_FIXED_FIELDS + PHASE_COUNT];
+  const char *service = NULL;
+  uint64_t total = now() - data->trace.started;
+  int n = 0;
+  int i;
+
+  pam_get_item(pamh, PAM_SERVICE, (const void **)(const void *)&service);
+
+#define TRACE_FIELD(...)                                                   \
+  do                                                                     \
+  {                                                                      \
+    int len;                                                             \
+    if (n >= (int)(sizeof(iov) / sizeof(iov[0])))                        \
+      break;                                                             \
+    len = snprintf(fields[n], sizeof(fields[n]), __VA_ARGS__);           \
+    iov[n].iov_base = fields[n];                                         \
+    iov[n].iov_len = MIN((size_t)MAX(len, 0), sizeof(fields[n]) - 1);    \
+    n++;                                                                 \
+  } while (0)
+
+  TRACE_FIELD("MESSAGE=Fingerprint authentication: %s in %" PRIu64 " ms",
+              auth_outcome_names[auth_outcome(data, ret)], total / USEC_PER_MSEC);
+  TRACE_FIELD("MESSAGE_ID=" TRACE_MESSAGE_ID);
+  TRACE_FIELD("PRIORITY=%d", LOG_INFO);
+  TRACE_FIELD("PAM_FPRINTD_SERVICE=%s", service ? service : "");
+  TRACE_FIELD("PAM_FPRINTD_OUTCOME=%s", auth_outcome_names[auth_outcome(data, ret)]);
+  TRACE_FIELD("PAM_FPRINTD_RESULT=%d", ret);
+  TRACE_FIELD("PAM_FPRINTD_RETRIES=%u", data->trace.retries);
+  TRACE_FIELD("PAM_FPRINTD_TOTAL_USEC=%" PRIu64, total);
+  TRACE_FIELD("PAM_FPRINTD_PROMPT_USEC=%" PRIu64,
+              data->trace.prompted ? data->trace.prompted - data->trace.started : 0);
+  TRACE_FIELD("PAM_FPRINTD_CPU_USEC=%" PRIu64, cpu_now() - data->trace.started_cpu);
+  for (i = 0; i < PHASE_COUNT; i++)
+    TRACE_FIELD("PAM_FPRINTD_%s_USEC=%" PRIu64, auth_phase_names[i], data->trace.phase_usec[i]);
+
+#undef TRACE_FIELD
+
+  sd_journal_sendv(iov, n);
+}
+
+/* Only adds to the shared counters, the textfile is rendered once the
+ * authentication is otherwise over. */
+static void
+record_metrics(pam_handle_t *pamh, const verify_data *data, int ret)
+{
+  auth_outcome_kind outcome = auth_outcome(data, ret);
+  auth_metrics *m = metrics_get();
+  int r;
+
+  if (!m)
+    return;
+
+  metrics_add(&m->outcomes[outcome], 1);
+  metrics_add(&m->duration_usec[outcome], now() - data->trace.started);
+  metrics_add(&m->retries, data->trace.retries);
+  if (outcome == OUTCOME_FINGERPRINT && data->trace.matched)
+    metrics_record_match(m, data->trace.matched - data->trace.started);
+
+  if (opts->metrics_textfile)
+  {
+    r = metrics_write_textfile(opts->metrics_textfile);
+    if (r < 0 && opts->debug)
+      pam_syslog(pamh, LOG_DEBUG, "Failed to write the metrics to %s: %d", opts->metrics_textfile, r);
+  }
+}
+
+/* "reauth" mode: rather than being closed at the end of an
+ * authentication, the bus connection, and with it fprintd's claim on the
+ * reader, is parked here. The next authentication of the same user in
+ * the same login session, typically the next unlock of a screen locker,
+ * picks it up and goes straight to VerifyStart. A reaper thread closes
+ * it once it sat unused for "reauth-idle=" seconds. */
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond; /* On CLOCK_MONOTONIC, once reaper_started */
+  bool reaper_started;
+
+  sd_bus *bus;
+  sd_bus_slot *owner_slot;
+  bool lost; /* fprintd went away while the claim was parked */
+  char *dev;
+  char *username;
+  char *session;
+  uint64_t idle_end;
+} reauth_cache;
+
+static reauth_cache reauth = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Linux-PAM unloads modules in pam_end(), the parked claim and the
+ * reaper thread must survive that. */
+static bool
+reauth_pin_module(void)
+{
+  Dl_info info;
+
+  if (!dladdr((void *)reauth_pin_module, &info) || !info.dli_fname)
+    return false;
+  return dlopen(info.dli_fname, RTLD_NOW | RTLD_NOLOAD | RTLD_NODELETE) != NULL;
+}
+
+static int
+reauth_name_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+  const char *name = NULL;
+
+  if (sd_bus_message_read(m, "s", &name) >= 0 && str_equal(name, "net.reactivated.Fprint"))
+    reauth.lost = true;
+
+  return 0;
+}
+
+/* Called with reauth.lock held */
+static void
+reauth_drop_locked(void)
+{
+  reauth.owner_slot = sd_bus_slot_unref(reauth.owner_slot);
+  /* Disconnecting is enough for fprintd to release the reader */
+  reauth.bus = sd_bus_flush_close_unref(reauth.bus);
+  free(reauth.dev);
+  free(reauth.username);
+  free(reauth.session);
+  reauth.dev = NULL;
+  reauth.username = NULL;
+  reauth.session = NULL;
+  reauth.lost = false;
+}
+
+static void *
+reauth_reaper(void *d)
+{
+  pthread_mutex_lock(&reauth.lock);
+  for (;;)
+  {
+    struct timespec deadline;
+
+    if (!reauth.bus)
+    {
+      pthread_cond_wait(&reauth.cond, &reauth.lock);
+      continue;
+    }
+    if (now() >= reauth.idle_end)
+    {
+      reauth_drop_locked();
+      continue;
+    }
+
+    deadline.tv_sec = reauth.idle_end / USEC_PER_SEC;
+    deadline.tv_nsec = (reauth.idle_end % USEC_PER_SEC) * NSEC_PER_USEC;
+    pthread_cond_timedwait(&reauth.cond, &reauth.lock, &deadline);
+  }
+
+  return NULL;
+}
+
+/* Called with reauth.lock held */
+static bool
+reauth_start_reaper(void)
+{
+  pthread_condattr_t attr;
+  pthread_attr_t thread_attr;
+  sigset_t all_signals;
+  sigset_t old_signals;
+  pthread_t thread;
+  int r;
+
+  if (reauth.reaper_started)
+    return true;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&reauth.cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  /* Leave the host application's signals to its own threads */
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+  pthread_attr_init(&thread_attr);
+  pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+  r = pthread_create(&thread, &thread_attr, reauth_reaper, NULL);
+  pthread_attr_destroy(&thread_attr);
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+  if (r != 0)
+  {
+    pthread_cond_destroy(&reauth.cond);
+    return false;
+  }
+  reauth.reaper_started = true;
+
+  return true;
+}
+
+/* Hands out the parked connection and the device it claimed, if they
+ * were parked for this user and session and are still usable. */
+static bool
+reauth_take(pam_handle_t *pamh, const char *username, sd_bus **ret_bus, char **ret_dev)
+{
+  pf_autofree char *session = NULL;
+  bool ret = false;
 
-      connect_name_owner_changed(bus, data, &name_owner_changed_slot);
+  if (sd_pid_get_session(0, &session) < 0)
+    return false;
 
-      if (debug)
-        pam_syslog(pamh, LOG_DEBUG, "In fingerprint mode");
+  pthread_mutex_lock(&reauth.lock);
+  if (!reauth.bus)
+  {
+    pthread_mutex_unlock(&reauth.lock);
+    return false;
+  }
 
-      // Set terminal to raw mode to detect keypress
-      if (term_fd >= 0)
-        tcsetattr(term_fd, TCSANOW, &term_attr);
+  /* Catch up on what happened while parked */
+  while (sd_bus_process(reauth.bus, NULL) > 0)
+    ;
 
-      if (!suppress_messages)
-        send_info_msg(pamh, _("Scan fingerprint or press any key to enter password"));
+  if (!reauth.lost && sd_bus_is_open(reauth.bus) && now() < reauth.idle_end &&
+      str_equal(reauth.username, username) && str_equal(reauth.session, session))
+  {
+    reauth.owner_slot = sd_bus_slot_unref(reauth.owner_slot);
+    *ret_bus = reauth.bus;
+    *ret_dev = reauth.dev;
+    reauth.bus = NULL;
+    reauth.dev = NULL;
+    ret = true;
+  }
+  else if (opts->debug)
+  {
+    pam_syslog(pamh, LOG_DEBUG, "Dropping the parked claim on %s", reauth.dev);
+  }
+  reauth_drop_locked();
+  pthread_mutex_unlock(&reauth.lock);
 
-      // wait all keys released before running verify
-      if (term_fd >= 0)
-      {
-        struct pollfd flush_fd = {term_fd, POLLIN, 0};
-        char c;
-        // First, read any pending input
-        while (poll(&flush_fd, 1, 0) > 0 && (flush_fd.revents & POLLIN))
-        {
-          if (read(term_fd, &c, 1) <= 0)
-            break;
-        }
-        // Then wait a short time to ensure no more keystrokes
-        usleep(100000); // 100ms should be enough
-        // Check one more time to ensure no new keystrokes
-        while (poll(&flush_fd, 1, 0) > 0 && (flush_fd.revents & POLLIN))
-        {
-          if (read(term_fd, &c, 1) > 0)
-          {
-            // If we got more input, switch to password mode
-            if (device_claimed)
-            {
-              release_device(pamh, bus, data->dev);
-              data->dev = NULL;
-            }
-            in_pw_mode = true;
-            if (debug)
-              pam_syslog(pamh, LOG_DEBUG, "Key detected while flushing, switching to password mode");
-            continue;
-          }
-          if (read(term_fd, &c, 1) <= 0)
-            break;
-        }
-      }
+  return ret;
+}
 
-      ret = do_verify(bus, data);
+/* Parks bus and its claim on dev. Returns false if the caller is to
+ * release them as usual. */
+static bool
+reauth_park(pam_handle_t *pamh, sd_bus *bus, const char *dev, const char *username)
+{
+  pf_autofree char *session = NULL;
+  char *dev_copy;
+  char *username_copy;
 
-      disconnect_name_owner_changed(bus, &name_owner_changed_slot);
+  if (sd_pid_get_session(0, &session) < 0)
+    return false;
 
-      pam_syslog(pamh, LOG_DEBUG, "Fprint returned %d", ret);
+  if (!reauth_pin_module())
+  {
+    pam_syslog(pamh, LOG_WARNING, "Cannot keep the module loaded, not parking the claim");
+    return false;
+  }
 
-      if (ret == PAM_SUCCESS)
-      {
-        if (term_fd >= 0)
-          tcsetattr(term_fd, TCSANOW, &term_attr_old);
-        if (!no_need_enter && !suppress_messages)
-        {
-          send_info_msg(pamh, _("Fingerprint OK, press ENTER"));
-        }
-        if (!no_need_enter)
-        {
-          const char *dummy_pw = "";
-          pam_set_item(pamh, PAM_AUTHTOK, dummy_pw);
-        }
-        return ret;
-      }
-      else
-      {
-        if (device_claimed)
-        {
-          pam_syslog(pamh, LOG_DEBUG, "Releasing fingerprint device");
-          release_device(pamh, bus, data->dev);
-          data->dev = NULL;
-          device_claimed = false;
-        }
-        if (max_tries_switch_to_pw && ret == PAM_MAXTRIES)
-        {
-          in_pw_mode = true;
-          data->max_tries = max_tries;
-          if (debug)
-            pam_syslog(pamh, LOG_DEBUG, "Max tries reached, switching to password mode");
-          continue;
-        }
-        if (ret == PAM_AUTHINFO_UNAVAIL)
-        {
-          // This means either a key was pressed or verification was interrupted
-          in_pw_mode = true;
-          if (debug)
-            pam_syslog(pamh, LOG_DEBUG, "Switching to password mode due to key press or interruption");
-          continue;
-        }
-      }
+  dev_copy = strdup(dev);
+  username_copy = strdup(username);
+  if (!dev_copy || !username_copy)
+  {
+    free(dev_copy);
+    free(username_copy);
+    return false;
+  }
 
-      // If we reach here, verification failed with an error
-      if (term_fd >= 0)
-        tcsetattr(term_fd, TCSANOW, &term_attr_old);
-      return ret;
-    }
+  pthread_mutex_lock(&reauth.lock);
+  reauth_drop_locked();
+  if (!reauth_start_reaper())
+  {
+    pthread_mutex_unlock(&reauth.lock);
+    free(dev_copy);
+    free(username_copy);
+    return false;
   }
 
-  return PAM_AUTHINFO_UNAVAIL;
+  /* Leave the reader idle rather than verifying, whichever way this
+   * authentication ended */
+  call_device_method_no_reply(bus, dev, "VerifyStop");
+  sd_bus_match_signal(bus,
+                      &reauth.owner_slot,
+                      "org.freedesktop.DBus",
+                      "/org/freedesktop/DBus",
+                      "org.freedesktop.DBus",
+                      "NameOwnerChanged",
+                      reauth_name_owner_changed,
+                      NULL);
+
+  reauth.bus = sd_bus_ref(bus);
+  reauth.dev = dev_copy;
+  reauth.username = username_copy;
+  reauth.session = session;
+  session = NULL;
+  reauth.idle_end = now() + opts->reauth_idle * USEC_PER_SEC;
+  pthread_cond_signal(&reauth.cond);
+  pthread_mutex_unlock(&reauth.lock);
+
+  if (opts->debug)
+    pam_syslog(pamh, LOG_DEBUG, "Parked the claim on %s for %u secs", dev, opts->reauth_idle);
+
+  return true;
 }
 
 static int
 do_auth(pam_handle_t *pamh, const char *username)
 {
-  pf_autoptr(verify_data) data = NULL;
+  verify_data *data;
   pf_autoptr(sd_bus) bus = NULL;
   int ret = PAM_AUTHINFO_UNAVAIL;
+  bool fprintd_present;
+  pf_autofree char *parked_dev = NULL;
+  bool reused = false;
+  bool parked = false;
+  pf_autoptr(pf_arena) arena = NULL;
+  int r;
+
+  /* Everything this authentication allocates, up to the readers'
+   * properties, comes from one arena that goes away with data. */
+  arena = pf_arena_new(AUTH_ARENA_SIZE);
+  if (!arena)
+    return PAM_BUF_ERR;
+  data = pf_arena_alloc(arena, sizeof(verify_data));
+  if (!data)
+    return PAM_BUF_ERR;
+  data->arena = arena;
+  arena = NULL;
+  data->wakeup_fd = -1;
+  data->max_tries = opts->max_tries;
+  data->opts = opts;
+  data->call_budget = opts->bus_budget_ms * USEC_PER_MSEC;
+
+  pthread_mutex_init(&data->input_mutex, NULL);
+  {
+    pthread_condattr_t attr;
 
-  data = calloc(1, sizeof(verify_data));
-  data->max_tries = max_tries;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&data->armed_cond, &attr);
+    pthread_condattr_destroy(&attr);
+  }
+
+  /* Replacing the data of an earlier authentication on this handle
+   * frees it. */
+  if (pam_set_data(pamh, AUTH_DATA_KEY, data, verify_data_cleanup) != PAM_SUCCESS)
+  {
+    verify_data_free(data);
+    return PAM_BUF_ERR;
+  }
   data->pamh = pamh;
+  data->msgs.pamh = pamh;
+  if (opts->bus_budget_ms > 0)
+    call_budget = &data->call_budget;
+  data->username = username;
   data->fingerprint_enabled = false; // Initialize to false by default
+  data->trace.started = now();
+  data->trace.started_cpu = cpu_now();
 
-  if (sd_bus_open_system(&bus) < 0)
+  /* Parked claims are only raced against the password thread, on a
+   * single reader */
+  if (opts->reauth && !OPT_NO_PTHREAD && !opts->multi_device)
+    reused = reauth_take(pamh, username, &bus, &parked_dev);
+
+  if (!reused)
   {
-    pam_syslog(pamh, LOG_ERR, "Error with getting the bus: %d", errno);
-    return PAM_AUTHINFO_UNAVAIL;
+    trace_begin(&data->trace, PHASE_BUS_CONNECT);
+    r = sd_bus_open_system(&bus);
+    trace_end(&data->trace, PHASE_BUS_CONNECT);
+    if (r < 0)
+    {
+      pam_syslog(pamh, LOG_ERR, "Error with getting the bus: %d", r);
+      return PAM_AUTHINFO_UNAVAIL;
+    }
   }
 
   data->stop_got_pw = false;
-  data->ppid = getpid();
 
-  if (no_pthread)
+  if (opts->no_autostart)
+    sd_bus_set_auto_start(bus, false);
+
+  fprintd_present = reused || fprintd_available(pamh, bus);
+  if (!fprintd_present && opts->debug)
+    pam_syslog(pamh, LOG_DEBUG, "fprintd is not available, going straight to password");
+
+  if (OPT_NO_PTHREAD)
   {
-    return do_auth_no_pthread(pamh, username, bus, data);
+    // assume we can use fingerprint until the device says otherwise
+    data->fingerprint_enabled = fprintd_present;
+    ret = do_auth_no_pthread(pamh, username, bus, data);
   }
   else
   {
     pf_autoptr(sd_bus_slot) name_owner_changed_slot = NULL;
     bool device_claimed = false;
     bool device_need_release = true;
-    data->dev = open_device(pamh, bus, username, &data->has_multiple_devices);
+    data->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (data->wakeup_fd < 0)
+    {
+      pam_syslog(pamh, LOG_ERR, "Failed to create wakeup eventfd: %s", strerror(errno));
+      close_bus(pamh, bus);
+      return PAM_SYSTEM_ERR;
+    }
+
+    if (reused)
+    {
+      data->dev = pf_arena_strdup(data->arena, parked_dev);
+      device_claimed = data->dev != NULL;
+      if (opts->debug)
+        pam_syslog(pamh, LOG_DEBUG, "Reusing the parked claim on %s", parked_dev);
+    }
+    else if (fprintd_present)
+    {
+      device_claimed = open_and_claim(pamh, bus, data, username);
+    }
     if (data->dev == NULL)
     {
-      if (debug)
+      if (opts->debug)
         pam_syslog(pamh, LOG_DEBUG, "No device found, falling back to password");
       // Continue to password prompt even with no device
     }
-
-    signal(SIGUSR1, handle_sigusr1);
-
-    // Try to claim the device if available
-    if (data->dev != NULL)
+    else
     {
-      device_claimed = claim_device(pamh, bus, data->dev, username);
-      if (debug && !device_claimed)
+      if (opts->debug && !device_claimed)
         pam_syslog(pamh, LOG_DEBUG, "Failed to claim device, falling back to password");
 
       // Set fingerprint_enabled flag if device is claimed successfully
@@ -1180,21 +3682,28 @@ do_auth(pam_handle_t *pamh, const char *username)
       connect_name_owner_changed(bus, data, &name_owner_changed_slot);
     }
 
-    // Always create password prompt thread
-    pthread_t pw_prompt_thread;
-    if (pthread_create(&pw_prompt_thread, NULL, prompt_pw, data) != 0)
+    if (!device_claimed)
     {
-      pam_syslog(pamh, LOG_ERR, "Failed to create thread: %s", strerror(errno));
-      if (device_claimed)
-        release_device(pamh, bus, data->dev);
-      sd_bus_close(bus);
-      return PAM_SYSTEM_ERR;
+      /* Nothing to race the password against, so prompt right here */
+      prompt_pw(data);
     }
-
-    // Only try fingerprint verification if device was claimed successfully
-    if (device_claimed)
+    else
     {
+      pthread_t pw_prompt_thread;
+      int abort_fd = prompt_abort_fd(pamh);
+      bool prompt_joined = false;
+
+      if (pthread_create(&pw_prompt_thread, NULL, prompt_pw, data) != 0)
+      {
+        pam_syslog(pamh, LOG_ERR, "Failed to create thread: %s", strerror(errno));
+        release_device(pamh, bus, data->dev, &data->trace);
+        release_peers(pamh, bus, data);
+        close_bus(pamh, bus);
+        return PAM_SYSTEM_ERR;
+      }
+
       ret = do_verify(bus, data);
+      verify_set_armed(data);
       disconnect_name_owner_changed(bus, &name_owner_changed_slot);
       if (ret == PAM_SUCCESS)
       {
@@ -1202,10 +3711,10 @@ do_auth(pam_handle_t *pamh, const char *username)
         device_need_release = false;
       }
 
-      pthread_mutex_lock(&input_mutex);
-      fingerprint_finished = true;
-      pthread_mutex_unlock(&input_mutex);
-      if (debug)
+      pthread_mutex_lock(&data->input_mutex);
+      data->fingerprint_finished = true;
+      pthread_mutex_unlock(&data->input_mutex);
+      if (opts->debug)
         pam_syslog(pamh, LOG_DEBUG, "Verify returned %d", ret);
 
       if (data->stop_got_pw)
@@ -1215,10 +3724,12 @@ do_auth(pam_handle_t *pamh, const char *username)
       }
       else if (ret == PAM_SUCCESS)
       {
-        if (!no_need_enter)
+        if (abort_fd >= 0)
+          prompt_joined = prompt_abort(pamh, abort_fd, pw_prompt_thread);
+        if (!opts->no_need_enter && !prompt_joined)
         {
-          if (!suppress_messages)
-            send_info_msg(pamh, _("Fingerprint OK, press ENTER"));
+          if (!OPT_SUPPRESS_MESSAGES)
+            queue_info_msg(&data->msgs, message_get(MSG_FP_OK_PRESS_ENTER));
           // Set a dummy password to indicate success
           const char *dummy_pw = "";
           pam_set_item(pamh, PAM_AUTHTOK, dummy_pw);
@@ -1226,26 +3737,28 @@ do_auth(pam_handle_t *pamh, const char *username)
       }
       else
       {
-        if (debug)
+        if (opts->debug)
           pam_syslog(pamh, LOG_DEBUG, "Verify returned %d, tell user to input password", ret);
-        if (!suppress_messages)
-          send_info_msg(pamh, _("Enter password"));
+        if (!OPT_SUPPRESS_MESSAGES)
+          queue_info_msg(&data->msgs, message_get(MSG_ENTER_PASSWORD));
       }
-    }
 
-    if (no_need_enter)
-    {
-      pthread_cancel(pw_prompt_thread);
+      flush_msgs(&data->msgs);
+      if (!prompt_joined)
+      {
+        if (opts->no_need_enter)
+          pthread_cancel(pw_prompt_thread);
+        // Wait for the password prompt thread to complete
+        pthread_join(pw_prompt_thread, NULL);
+      }
+      if (opts->debug)
+        pam_syslog(pamh, LOG_DEBUG, "PW prompt thread joined");
     }
-    // Wait for the password prompt thread to complete
-    pthread_join(pw_prompt_thread, NULL);
-    if (debug)
-      pam_syslog(pamh, LOG_DEBUG, "PW prompt thread joined");
 
     // Check if we got a password
     if (data->stop_got_pw)
     {
-      if (debug)
+      if (opts->debug)
         pam_syslog(pamh, LOG_DEBUG, "Authentication continues with password");
       if (data->pam_prompt_result == PAM_SUCCESS)
       {
@@ -1256,13 +3769,29 @@ do_auth(pam_handle_t *pamh, const char *username)
         ret = PAM_AUTH_ERR;
       }
     }
-    if (device_claimed && device_need_release)
-      release_device(pamh, bus, data->dev);
+    if (device_claimed && opts->reauth && data->num_peers == 0 &&
+        reauth_park(pamh, bus, data->dev, username))
+    {
+      parked = true;
+    }
+    else if (device_claimed && device_need_release)
+    {
+      release_device(pamh, bus, data->dev, &data->trace);
+      release_peers(pamh, bus, data);
+    }
   }
 
-  sd_bus_close(bus);
+  if (!parked)
+    close_bus(pamh, bus);
+  flush_msgs(&data->msgs);
+
+  if (opts->trace_enabled)
+    emit_trace(pamh, data, ret);
+  if (opts->metrics_enabled)
+    record_metrics(pamh, data, ret);
+  pam_set_data(pamh, AUTH_DATA_KEY, NULL, NULL);
 
-  if (debug)
+  if (opts->debug)
     pam_syslog(pamh, LOG_DEBUG, "Returning %d", ret);
   return ret;
 }
@@ -1288,21 +3817,42 @@ is_remote(pam_handle_t *pamh)
   return false;
 }
 
-PAM_EXTERN int
-pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
-                    const char **argv)
+/* Timeouts are in seconds, or in milliseconds with an "ms" suffix, up to
+ * a day. Negative values disable the timeout. */
+static bool
+parse_timeout_ms(const char *s, uint64_t *ret)
 {
-  const char *username;
-  int i;
+  unsigned long long value;
+  uint64_t unit = 1000;
+  char *end;
 
-  bindtextdomain(GETTEXT_PACKAGE, LOCALEDIR);
-  bind_textdomain_codeset(GETTEXT_PACKAGE, "UTF-8");
+  if (s[0] == '-')
+  {
+    *ret = UINT64_MAX;
+    return true;
+  }
 
-  if (is_remote(pamh))
-    return PAM_AUTHINFO_UNAVAIL;
+  errno = 0;
+  value = strtoull(s, &end, 10);
+  if (errno != 0 || end == s)
+    return false;
+  if (str_equal(end, "ms"))
+    unit = 1;
+  else if (*end != '\0' && !str_equal(end, "s"))
+    return false;
+  if (value > MAX_TIMEOUT_MS / unit)
+    return false;
 
-  if (pam_get_user(pamh, &username, NULL) != PAM_SUCCESS)
-    return PAM_AUTHINFO_UNAVAIL;
+  *ret = value * unit;
+  return true;
+}
+
+static void
+options_parse(pam_handle_t *pamh, int argc, const char **argv, module_options *o)
+{
+  int i;
+
+  *o = default_options;
 
   for (i = 0; i < argc; i++)
   {
@@ -1311,12 +3861,12 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
       if (str_equal(argv[i], "debug"))
       {
         pam_syslog(pamh, LOG_DEBUG, "debug on");
-        debug = true;
+        o->debug = true;
       }
       else if (str_equal(argv[i], FP_MAX_TRIES_SWITCH_TO_PW))
       {
         pam_syslog(pamh, LOG_DEBUG, "Fingerprint max tries switch to password");
-        max_tries_switch_to_pw = true;
+        o->max_tries_switch_to_pw = true;
       }
       else if (str_has_prefix(argv[i], DEBUG_MATCH))
       {
@@ -1329,13 +3879,13 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
             str_equal(value, "1"))
         {
           pam_syslog(pamh, LOG_DEBUG, "debug on");
-          debug = true;
+          o->debug = true;
         }
         else if (str_equal(value, "off") ||
                  str_equal(value, "false") ||
                  str_equal(value, "0"))
         {
-          debug = false;
+          o->debug = false;
         }
         else
         {
@@ -1345,59 +3895,260 @@ pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
       else if (str_has_prefix(argv[i], MAX_TRIES_MATCH) && strlen(argv[i]) > strlen(MAX_TRIES_MATCH))
       {
         int opt_max_tries = atoi(argv[i] + strlen(MAX_TRIES_MATCH));
-        max_tries = (opt_max_tries < 0 ? UINT_MAX : (unsigned)opt_max_tries);
-        if (max_tries < 1)
+        o->max_tries = (opt_max_tries < 0 ? UINT_MAX : (unsigned)opt_max_tries);
+        if (o->max_tries < 1)
         {
-          if (debug)
+          if (o->debug)
             pam_syslog(pamh, LOG_DEBUG, "invalid max tries '%s', using %d",
                        argv[i] + strlen(MAX_TRIES_MATCH), DEFAULT_MAX_TRIES);
-          max_tries = DEFAULT_MAX_TRIES;
+          o->max_tries = DEFAULT_MAX_TRIES;
         }
-        if (debug)
-          pam_syslog(pamh, LOG_DEBUG, "max_tries specified as: %d", max_tries);
+        if (o->debug)
+          pam_syslog(pamh, LOG_DEBUG, "max_tries specified as: %d", o->max_tries);
       }
-      else if (str_has_prefix(argv[i], TIMEOUT_MATCH) && strlen(argv[i]) <= strlen(TIMEOUT_MATCH) + 2)
+      else if (str_has_prefix(argv[i], TIMEOUT_MATCH))
       {
-        int opt_timeout = atoi(argv[i] + strlen(TIMEOUT_MATCH));
-        timeout = (opt_timeout < 0 ? UINT_MAX : (unsigned)opt_timeout);
-        if (timeout < MIN_TIMEOUT)
+        if (!parse_timeout_ms(argv[i] + strlen(TIMEOUT_MATCH), &o->timeout_ms))
+        {
+          pam_syslog(pamh, LOG_WARNING, "invalid timeout '%s', using %d secs",
+                     argv[i] + strlen(TIMEOUT_MATCH), DEFAULT_TIMEOUT);
+          o->timeout_ms = DEFAULT_TIMEOUT * 1000;
+        }
+        else if (o->timeout_ms < MIN_TIMEOUT * 1000)
         {
-          if (debug)
-            pam_syslog(pamh, LOG_DEBUG, "timeout %d secs too low, using %d",
-                       timeout, MIN_TIMEOUT);
-          timeout = MIN_TIMEOUT;
+          if (o->debug)
+            pam_syslog(pamh, LOG_DEBUG, "timeout %" PRIu64 " ms too low, using %d secs",
+                       o->timeout_ms, MIN_TIMEOUT);
+          o->timeout_ms = MIN_TIMEOUT * 1000;
         }
-        else if (debug)
+        else if (o->debug)
         {
-          pam_syslog(pamh, LOG_DEBUG, "timeout specified as: %d secs", timeout);
+          pam_syslog(pamh, LOG_DEBUG, "timeout specified as: %" PRIu64 " ms", o->timeout_ms);
         }
       }
       else if (str_has_prefix(argv[i], NO_NEED_ENTER_MATCH) && strlen(argv[i]) <= strlen(NO_NEED_ENTER_MATCH) + 2)
       {
-        no_need_enter = true;
+        o->no_need_enter = true;
       }
       else if (str_has_prefix(argv[i], NO_PTHREAD_MATCH) && strlen(argv[i]) <= strlen(NO_PTHREAD_MATCH) + 2)
       {
-        no_pthread = true;
+        o->no_pthread = true;
       }
       else if (str_has_prefix(argv[i], NO_PTHREAD_PW_FIRST_MATCH) && strlen(argv[i]) <= strlen(NO_PTHREAD_PW_FIRST_MATCH) + 2)
       {
-        no_pthread = true;
-        pw_first = true;
+        o->no_pthread = true;
+        o->pw_first = true;
       }
       else if (str_has_prefix(argv[i], SUPPRESS_MESSAGES_MATCH) && strlen(argv[i]) <= strlen(SUPPRESS_MESSAGES_MATCH) + 2)
       {
-        suppress_messages = true;
+        o->suppress_messages = true;
+      }
+      else if (str_equal(argv[i], BROKER_MATCH))
+      {
+        o->use_broker = true;
+      }
+      else if (str_equal(argv[i], ASYNC_RELEASE_MATCH))
+      {
+        o->async_release = true;
+      }
+      else if (str_equal(argv[i], PREWARM_MATCH))
+      {
+        o->prewarm_enabled = true;
+      }
+      else if (str_equal(argv[i], TRACE_MATCH))
+      {
+        o->trace_enabled = true;
+      }
+      else if (str_equal(argv[i], MULTI_DEVICE_MATCH))
+      {
+        o->multi_device = true;
+      }
+      else if (str_equal(argv[i], ADAPTIVE_TIMEOUT_MATCH))
+      {
+        o->adaptive_timeout = true;
+      }
+      else if (str_equal(argv[i], METRICS_MATCH))
+      {
+        o->metrics_enabled = true;
+      }
+      else if (str_has_prefix(argv[i], METRICS_TEXTFILE_MATCH))
+      {
+        o->metrics_enabled = true;
+        o->metrics_textfile = argv[i] + strlen(METRICS_TEXTFILE_MATCH);
+      }
+      else if (str_equal(argv[i], READER_BACKOFF_MATCH))
+      {
+        o->reader_backoff = true;
+      }
+      else if (str_equal(argv[i], REAUTH_MATCH))
+      {
+        o->reauth = true;
+      }
+      else if (str_has_prefix(argv[i], REAUTH_IDLE_MATCH) && strlen(argv[i]) > strlen(REAUTH_IDLE_MATCH))
+      {
+        int opt_idle = atoi(argv[i] + strlen(REAUTH_IDLE_MATCH));
+        o->reauth_idle = opt_idle < 0 ? 0 : (unsigned)opt_idle;
+        if (o->debug)
+          pam_syslog(pamh, LOG_DEBUG, "reauth idle time specified as: %u secs", o->reauth_idle);
+      }
+      else if (str_has_prefix(argv[i], BUS_BUDGET_MATCH))
+      {
+        if (!parse_timeout_ms(argv[i] + strlen(BUS_BUDGET_MATCH), &o->bus_budget_ms))
+        {
+          pam_syslog(pamh, LOG_WARNING, "invalid bus budget '%s', ignoring",
+                     argv[i] + strlen(BUS_BUDGET_MATCH));
+          o->bus_budget_ms = 0;
+        }
+        else if (o->bus_budget_ms == UINT64_MAX)
+        {
+          o->bus_budget_ms = 0;
+        }
+        if (o->debug)
+          pam_syslog(pamh, LOG_DEBUG, "bus budget specified as: %" PRIu64 " ms", o->bus_budget_ms);
+      }
+      else if (str_equal(argv[i], NO_AUTOSTART_MATCH))
+      {
+        o->no_autostart = true;
+      }
+      else if (str_has_prefix(argv[i], ENROLL_CACHE_TTL_MATCH) && strlen(argv[i]) > strlen(ENROLL_CACHE_TTL_MATCH))
+      {
+        int opt_ttl = atoi(argv[i] + strlen(ENROLL_CACHE_TTL_MATCH));
+        o->enroll_cache_ttl = opt_ttl < 0 ? 0 : (unsigned)opt_ttl;
+        if (o->debug)
+          pam_syslog(pamh, LOG_DEBUG, "enrollment cache TTL specified as: %u secs", o->enroll_cache_ttl);
+      }
+      else if (str_has_prefix(argv[i], KEY_DEBOUNCE_MATCH) && strlen(argv[i]) > strlen(KEY_DEBOUNCE_MATCH))
+      {
+        int opt_debounce = atoi(argv[i] + strlen(KEY_DEBOUNCE_MATCH));
+        o->key_debounce_ms = opt_debounce < 0 ? 0 : (unsigned)opt_debounce;
+        if (o->key_debounce_ms > MAX_KEY_DEBOUNCE_MS)
+          o->key_debounce_ms = MAX_KEY_DEBOUNCE_MS;
+        if (o->debug)
+          pam_syslog(pamh, LOG_DEBUG, "key debounce specified as: %u ms", o->key_debounce_ms);
+      }
+      else
+      {
+        pam_syslog(pamh, LOG_WARNING, "unknown option '%s'", argv[i]);
       }
     }
   }
 
-  if (no_pthread)
+#ifdef PF_VARIANT_NO_PTHREAD
+  o->no_pthread = true;
+#endif
+#ifdef PF_VARIANT_QUIET
+  o->suppress_messages = true;
+#endif
+  if (o->no_pthread)
+  {
+    o->no_need_enter = true;
+  }
+}
+
+typedef struct
+{
+  module_options options;
+  char *args; /* The arguments they were parsed from, one per line */
+} options_cache;
+
+static void
+options_cache_cleanup(pam_handle_t *pamh, void *data, int error_status)
+{
+  options_cache *cache = data;
+
+  free(cache->args);
+  free(cache);
+}
+
+static char *
+options_join(int argc, const char **argv)
+{
+  size_t len = 1;
+  char *args;
+  int i;
+
+  for (i = 0; i < argc; i++)
+    len += (argv[i] ? strlen(argv[i]) : 0) + 1;
+
+  args = calloc(1, len);
+  if (!args)
+    return NULL;
+
+  for (i = 0; i < argc; i++)
+  {
+    if (argv[i])
+      strcat(args, argv[i]);
+    strcat(args, "\n");
+  }
+
+  return args;
+}
+
+/* Options are parsed on the first call for a handle, later calls with the
+ * same arguments reuse them. The same handle can go through this module
+ * more than once with different arguments, hence the comparison. */
+#define OPTIONS_DATA_KEY "pam_fprintd_grosshack_options"
+
+static const module_options *
+options_get(pam_handle_t *pamh, int argc, const char **argv)
+{
+  const options_cache *cached = NULL;
+  options_cache *cache;
+  char *args;
+
+  args = options_join(argc, argv);
+  if (!args)
+    return NULL;
+
+  if (pam_get_data(pamh, OPTIONS_DATA_KEY, (const void **)(const void *)&cached) == PAM_SUCCESS &&
+      cached && str_equal(cached->args, args))
+  {
+    free(args);
+    return &cached->options;
+  }
+
+  cache = calloc(1, sizeof(options_cache));
+  if (!cache)
+  {
+    free(args);
+    return NULL;
+  }
+  cache->args = args;
+  options_parse(pamh, argc, argv, &cache->options);
+
+  if (pam_set_data(pamh, OPTIONS_DATA_KEY, cache, options_cache_cleanup) != PAM_SUCCESS)
   {
-    no_need_enter = true;
+    options_cache_cleanup(pamh, cache, 0);
+    return NULL;
   }
 
-  return do_auth(pamh, username);
+  return &cache->options;
+}
+
+PAM_EXTERN int
+pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
+                    const char **argv)
+{
+  const module_options *options;
+  const char *username;
+  int r;
+
+  if (is_remote(pamh))
+    return PAM_AUTHINFO_UNAVAIL;
+
+  if (pam_get_user(pamh, &username, NULL) != PAM_SUCCESS)
+    return PAM_AUTHINFO_UNAVAIL;
+
+  options = options_get(pamh, argc, argv);
+  if (!options)
+    return PAM_BUF_ERR;
+  opts = options;
+
+  r = do_auth(pamh, username);
+  /* It pointed into the data of this authentication */
+  call_budget = NULL;
+
+  return r;
 }
 
 PAM_EXTERN int
@@ -0,0 +1,129 @@
+/*
+ * pam_fprint: bump allocator for the memory of one authentication
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "pam_fprintd_autoptrs.h"
+
+/* Allocations are never freed one by one, they all go away with the
+ * arena. The arena header lives in its first chunk, so that an arena
+ * that did not outgrow it is a single malloc() and a single free().
+ * Not thread-safe: callers make sure only one thread allocates at a
+ * time. */
+#define PF_ARENA_ALIGN ((size_t)__BIGGEST_ALIGNMENT__)
+
+typedef struct pf_arena_chunk
+{
+  struct pf_arena_chunk *next;
+  size_t size;
+  size_t used;
+  char data[] __attribute__((aligned(__BIGGEST_ALIGNMENT__)));
+} pf_arena_chunk;
+
+typedef struct
+{
+  pf_arena_chunk *chunks;
+  pf_arena_chunk first;
+} pf_arena;
+
+static inline size_t
+pf_arena_align(size_t size)
+{
+  return (size + PF_ARENA_ALIGN - 1) & ~(PF_ARENA_ALIGN - 1);
+}
+
+static inline pf_arena *
+pf_arena_new(size_t size)
+{
+  pf_arena *arena;
+
+  size = pf_arena_align(size);
+  arena = malloc(sizeof(pf_arena) + size);
+  if (!arena)
+    return NULL;
+
+  arena->first.next = NULL;
+  arena->first.size = size;
+  arena->first.used = 0;
+  arena->chunks = &arena->first;
+
+  return arena;
+}
+
+static inline void
+pf_arena_free(pf_arena *arena)
+{
+  pf_arena_chunk *chunk;
+
+  if (!arena)
+    return;
+
+  chunk = arena->chunks;
+  while (chunk != &arena->first)
+  {
+    pf_arena_chunk *next = chunk->next;
+
+    free(chunk);
+    chunk = next;
+  }
+  free(arena);
+}
+
+/* Zeroed, like calloc() */
+static inline void *
+pf_arena_alloc(pf_arena *arena, size_t size)
+{
+  pf_arena_chunk *chunk = arena->chunks;
+  void *p;
+
+  size = pf_arena_align(size ? size : 1);
+  if (size > chunk->size - chunk->used)
+  {
+    size_t chunk_size = MAX(size, arena->first.size);
+
+    chunk = malloc(sizeof(pf_arena_chunk) + chunk_size);
+    if (!chunk)
+      return NULL;
+    chunk->next = arena->chunks;
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    arena->chunks = chunk;
+  }
+
+  p = chunk->data + chunk->used;
+  chunk->used += size;
+
+  return memset(p, 0, size);
+}
+
+static inline char *
+pf_arena_strdup(pf_arena *arena, const char *s)
+{
+  size_t len = strlen(s) + 1;
+  char *n = pf_arena_alloc(arena, len);
+
+  return n ? memcpy(n, s, len) : NULL;
+}
+
+PF_DEFINE_AUTOPTR_CLEANUP_FUNC(pf_arena, pf_arena_free)
@@ -20,6 +20,7 @@
 #pragma once
 
 #include <stdlib.h>
+#include <systemd/sd-bus.h>
 
 /* Define auto-pointers functions, based on GLib Macros */
 
@@ -0,0 +1,320 @@
+/*
+ * pam_fprint: authentication counters shared by all processes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pam_fprintd_state.h"
+
+/* The counters live in a file under the state directory that every
+ * process running the module maps shared and updates with atomic adds,
+ * so counting takes no lock and no formatting. The node_exporter
+ * textfile is rendered from it once an authentication is over. */
+#define METRICS_FILE "metrics"
+#define METRICS_MAGIC UINT64_C(0x31544d4548474650) /* "PFGHEMT1" */
+#define METRICS_TEXTFILE "pam_fprintd_grosshack.prom"
+#define METRICS_TEXTFILE_MAX 4096
+
+typedef enum
+{
+  OUTCOME_FINGERPRINT,
+  OUTCOME_PASSWORD,
+  OUTCOME_MAX_TRIES,
+  OUTCOME_TIMEOUT,
+  OUTCOME_NO_DEVICE,
+  OUTCOME_ERROR,
+  OUTCOME_COUNT,
+} auth_outcome_kind;
+
+static const char *const auth_outcome_names[OUTCOME_COUNT] = {
+    [OUTCOME_FINGERPRINT] = "fingerprint",
+    [OUTCOME_PASSWORD] = "password",
+    [OUTCOME_MAX_TRIES] = "max-tries",
+    [OUTCOME_TIMEOUT] = "timeout",
+    [OUTCOME_NO_DEVICE] = "no-device",
+    [OUTCOME_ERROR] = "error",
+};
+
+/* Upper bounds of the time-to-match histogram buckets, in ms */
+static const uint64_t metrics_match_buckets_ms[] = {250, 500, 1000, 2000, 4000, 8000, 16000};
+#define METRICS_MATCH_BUCKETS (sizeof(metrics_match_buckets_ms) / sizeof(metrics_match_buckets_ms[0]))
+
+/* The layout of the file, changing it means changing the magic */
+typedef struct
+{
+  uint64_t magic;
+  uint64_t outcomes[OUTCOME_COUNT];
+  uint64_t duration_usec[OUTCOME_COUNT];
+  uint64_t retries;
+  uint64_t fprintd_failures;
+  uint64_t match_buckets[METRICS_MATCH_BUCKETS]; /* Not cumulative */
+  uint64_t match_usec;
+  uint64_t matches;
+} auth_metrics;
+
+static struct
+{
+  pthread_once_t once;
+  int fd;
+  auth_metrics *map;
+  pthread_mutex_t render_lock; /* flock() does not exclude other threads */
+} metrics_file = {
+  .once = PTHREAD_ONCE_INIT,
+  .fd = -1,
+  .render_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static inline void
+metrics_file_init(void)
+{
+  char path[STATE_PATH_MAX];
+  struct stat st;
+  uint64_t expected = 0;
+  void *map;
+  int fd;
+
+  if ((mkdir(STATE_DIR, 0700) < 0 && errno != EEXIST) ||
+      state_path(path, sizeof(path), METRICS_FILE, NULL) < 0)
+    return;
+
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+  if (fd < 0)
+    return;
+
+  /* Growing it is harmless when another process does it at the same
+   * time, the new part reads as zeroes for both. */
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+      (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+      ((size_t)st.st_size < sizeof(auth_metrics) && ftruncate(fd, sizeof(auth_metrics)) < 0))
+  {
+    close(fd);
+    return;
+  }
+
+  map = mmap(NULL, sizeof(auth_metrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    close(fd);
+    return;
+  }
+
+  /* A file of another layout is left alone, counting resumes after a
+   * reboot. */
+  if (!__atomic_compare_exchange_n(&((auth_metrics *)map)->magic, &expected, METRICS_MAGIC,
+                                   false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) &&
+      expected != METRICS_MAGIC)
+  {
+    munmap(map, sizeof(auth_metrics));
+    close(fd);
+    return;
+  }
+
+  metrics_file.fd = fd;
+  metrics_file.map = map;
+}
+
+/* The module is unloaded at pam_end(), there would be one more fd and
+ * mapping left behind for each authentication otherwise */
+__attribute__((destructor)) static void
+metrics_file_destroy(void)
+{
+  if (metrics_file.map)
+    munmap(metrics_file.map, sizeof(auth_metrics));
+  if (metrics_file.fd >= 0)
+    close(metrics_file.fd);
+  metrics_file.map = NULL;
+  metrics_file.fd = -1;
+}
+
+/* NULL when the counters cannot be kept, e.g. when running unprivileged */
+static inline auth_metrics *
+metrics_get(void)
+{
+  pthread_once(&metrics_file.once, metrics_file_init);
+  return metrics_file.map;
+}
+
+static inline void
+metrics_add(uint64_t *counter, uint64_t n)
+{
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+metrics_read(const uint64_t *counter)
+{
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline void
+metrics_record_match(auth_metrics *m, uint64_t usec)
+{
+  size_t i;
+
+  for (i = 0; i < METRICS_MATCH_BUCKETS; i++)
+  {
+    if (usec <= metrics_match_buckets_ms[i] * 1000)
+    {
+      metrics_add(&m->match_buckets[i], 1);
+      break;
+    }
+  }
+  metrics_add(&m->match_usec, usec);
+  metrics_add(&m->matches, 1);
+}
+
+#define METRICS_PREFIX "pam_fprintd_grosshack_"
+/* Not with %f, the host application may have set a locale that uses a
+ * decimal comma. */
+#define METRICS_USEC_FMT "%" PRIu64 ".%06" PRIu64
+#define METRICS_USEC_ARG(usec) (usec) / 1000000, (usec) % 1000000
+
+/* Formats the counters for the node_exporter textfile collector.
+ * Returns the length, or -1 if buf is too small. */
+static inline int
+metrics_render(const auth_metrics *m, char *buf, size_t len)
+{
+  uint64_t cumulative = 0;
+  size_t n = 0;
+  size_t i;
+  int r;
+
+#define METRICS_PRINT(...)                             \
+  do                                                   \
+  {                                                    \
+    r = snprintf(buf + n, len - n, __VA_ARGS__);       \
+    if (r < 0 || (size_t)r >= len - n)                 \
+      return -1;                                       \
+    n += r;                                            \
+  } while (0)
+
+  METRICS_PRINT("# HELP " METRICS_PREFIX "authentications_total Authentications by outcome.\n"
+                "# TYPE " METRICS_PREFIX "authentications_total counter\n");
+  for (i = 0; i < OUTCOME_COUNT; i++)
+    METRICS_PRINT(METRICS_PREFIX "authentications_total{outcome=\"%s\"} %" PRIu64 "\n",
+                  auth_outcome_names[i], metrics_read(&m->outcomes[i]));
+
+  METRICS_PRINT("# HELP " METRICS_PREFIX "authentication_seconds_total Time spent in authentications by outcome.\n"
+                "# TYPE " METRICS_PREFIX "authentication_seconds_total counter\n");
+  for (i = 0; i < OUTCOME_COUNT; i++)
+    METRICS_PRINT(METRICS_PREFIX "authentication_seconds_total{outcome=\"%s\"} " METRICS_USEC_FMT "\n",
+                  auth_outcome_names[i], METRICS_USEC_ARG(metrics_read(&m->duration_usec[i])));
+
+  METRICS_PRINT("# HELP " METRICS_PREFIX "retries_total Scans that had to be retried.\n"
+                "# TYPE " METRICS_PREFIX "retries_total counter\n"
+                METRICS_PREFIX "retries_total %" PRIu64 "\n",
+                metrics_read(&m->retries));
+
+  METRICS_PRINT("# HELP " METRICS_PREFIX "fprintd_failures_total Verify errors, reader disconnects and fprintd exits.\n"
+                "# TYPE " METRICS_PREFIX "fprintd_failures_total counter\n"
+                METRICS_PREFIX "fprintd_failures_total %" PRIu64 "\n",
+                metrics_read(&m->fprintd_failures));
+
+  METRICS_PRINT("# HELP " METRICS_PREFIX "time_to_match_seconds Time from the start of an authentication to a fingerprint match.\n"
+                "# TYPE " METRICS_PREFIX "time_to_match_seconds histogram\n");
+  for (i = 0; i < METRICS_MATCH_BUCKETS; i++)
+  {
+    cumulative += metrics_read(&m->match_buckets[i]);
+    METRICS_PRINT(METRICS_PREFIX "time_to_match_seconds_bucket{le=\"%" PRIu64 ".%03" PRIu64 "\"} %" PRIu64 "\n",
+                  metrics_match_buckets_ms[i] / 1000, metrics_match_buckets_ms[i] % 1000, cumulative);
+  }
+  METRICS_PRINT(METRICS_PREFIX "time_to_match_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n"
+                METRICS_PREFIX "time_to_match_seconds_sum " METRICS_USEC_FMT "\n"
+                METRICS_PREFIX "time_to_match_seconds_count %" PRIu64 "\n",
+                metrics_read(&m->matches), METRICS_USEC_ARG(metrics_read(&m->match_usec)),
+                metrics_read(&m->matches));
+
+#undef METRICS_PRINT
+
+  return n;
+}
+
+/* Replaces dir/METRICS_TEXTFILE. Renders are serialized on the counters
+ * file, so that a slower process cannot rename an older snapshot over a
+ * newer one and make counters go backwards. The lock is taken through
+ * the fd every thread shares, so threads of one process are serialized
+ * by render_lock, which also keeps them off each other's temp file. */
+static inline int
+metrics_write_textfile(const char *dir)
+{
+  auth_metrics *m = metrics_get();
+  char buf[METRICS_TEXTFILE_MAX];
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX + 16];
+  ssize_t written;
+  int len;
+  int fd;
+  int r;
+
+  if (!m)
+    return -ENOENT;
+
+  r = snprintf(path, sizeof(path), "%s/%s", dir, METRICS_TEXTFILE);
+  if (r < 0 || (size_t)r >= sizeof(path))
+    return -ENAMETOOLONG;
+  /* node_exporter skips files that do not end in .prom */
+  r = snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path, (long)getpid());
+  if (r < 0 || (size_t)r >= sizeof(tmp_path))
+    return -ENAMETOOLONG;
+
+  pthread_mutex_lock(&metrics_file.render_lock);
+  if (flock(metrics_file.fd, LOCK_EX) < 0)
+  {
+    r = -errno;
+    pthread_mutex_unlock(&metrics_file.render_lock);
+    return r;
+  }
+
+  len = metrics_render(m, buf, sizeof(buf));
+  if (len < 0)
+  {
+    r = -ENOBUFS;
+    goto out;
+  }
+
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0644);
+  if (fd < 0)
+  {
+    r = -errno;
+    goto out;
+  }
+  written = write(fd, buf, len);
+  r = written < 0 ? -errno : written != len ? -EIO : 0;
+  close(fd);
+
+  if (r == 0 && rename(tmp_path, path) < 0)
+    r = -errno;
+  if (r < 0)
+    unlink(tmp_path);
+
+out:
+  flock(metrics_file.fd, LOCK_UN);
+  pthread_mutex_unlock(&metrics_file.render_lock);
+  return r;
+}
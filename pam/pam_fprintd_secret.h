@@ -0,0 +1,181 @@
+/*
+ * pam_fprint: locked memory for the passwords we handle
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Passwords are moved out of the buffer the conversation function gave
+ * us into fixed-size slots of one mapping that is locked in memory, left
+ * out of core dumps and not inherited by forked children. The mapping
+ * is set up on first use and kept until the module is unloaded, freeing
+ * a slot wipes it whole. When the pool is exhausted, or a password is
+ * longer than a slot, a heap copy is used instead. */
+#define SECRET_SLOTS 8
+#define SECRET_SLOT_SIZE 512 /* PAM_MAX_RESP_SIZE */
+
+static struct
+{
+  pthread_once_t once;
+  pthread_mutex_t lock;
+  char *base;
+  size_t size;
+  uint32_t used; /* One bit per slot */
+} secret_pool = {
+  .once = PTHREAD_ONCE_INIT,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static inline void
+secret_pool_init(void)
+{
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t size = SECRET_SLOTS * SECRET_SLOT_SIZE;
+  void *base;
+
+  if (page_size > 0)
+    size = (size + page_size - 1) & ~((size_t)page_size - 1);
+
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return;
+
+  /* Best effort: an unprivileged process may be over RLIMIT_MEMLOCK, a
+   * slot is still better than the heap then. */
+  (void)mlock(base, size);
+#ifdef MADV_DONTDUMP
+  (void)madvise(base, size, MADV_DONTDUMP);
+#endif
+#ifdef MADV_WIPEONFORK
+  (void)madvise(base, size, MADV_WIPEONFORK);
+#endif
+
+  secret_pool.base = base;
+  secret_pool.size = size;
+}
+
+/* Linux-PAM unloads the module at pam_end(), a process that keeps
+ * authenticating would otherwise pile up locked mappings until it hits
+ * RLIMIT_MEMLOCK. */
+__attribute__((destructor)) static void
+secret_pool_destroy(void)
+{
+  if (!secret_pool.base)
+    return;
+
+  explicit_bzero(secret_pool.base, secret_pool.size);
+  (void)munlock(secret_pool.base, secret_pool.size);
+  munmap(secret_pool.base, secret_pool.size);
+  secret_pool.base = NULL;
+}
+
+static inline bool
+secret_in_pool(const char *secret)
+{
+  return secret_pool.base && secret >= secret_pool.base &&
+         secret < secret_pool.base + SECRET_SLOTS * SECRET_SLOT_SIZE;
+}
+
+static inline char *
+secret_slot_get(void)
+{
+  char *slot = NULL;
+  unsigned i;
+
+  pthread_once(&secret_pool.once, secret_pool_init);
+  if (!secret_pool.base)
+    return NULL;
+
+  pthread_mutex_lock(&secret_pool.lock);
+  for (i = 0; i < SECRET_SLOTS; i++)
+  {
+    if (!(secret_pool.used & (1u << i)))
+    {
+      secret_pool.used |= 1u << i;
+      slot = secret_pool.base + i * SECRET_SLOT_SIZE;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&secret_pool.lock);
+
+  return slot;
+}
+
+static inline void
+secret_free(char *secret)
+{
+  unsigned i;
+
+  if (!secret)
+    return;
+
+  if (!secret_in_pool(secret))
+  {
+    explicit_bzero(secret, strlen(secret));
+    free(secret);
+    return;
+  }
+
+  explicit_bzero(secret, SECRET_SLOT_SIZE);
+  i = (secret - secret_pool.base) / SECRET_SLOT_SIZE;
+  pthread_mutex_lock(&secret_pool.lock);
+  secret_pool.used &= ~(1u << i);
+  pthread_mutex_unlock(&secret_pool.lock);
+}
+
+/* Takes over a response from pam_prompt(): *resp is wiped, freed and
+ * reset. Returns NULL if there was no response. */
+static inline char *
+secret_take(char **resp)
+{
+  char *secret;
+  size_t len;
+
+  if (!*resp)
+    return NULL;
+
+  len = strlen(*resp);
+  if (len >= SECRET_SLOT_SIZE || !(secret = secret_slot_get()))
+  {
+    /* Nowhere better to keep it */
+    secret = *resp;
+    *resp = NULL;
+    return secret;
+  }
+
+  memcpy(secret, *resp, len + 1);
+  explicit_bzero(*resp, len);
+  free(*resp);
+  *resp = NULL;
+
+  return secret;
+}
+
+static inline void
+secret_cleanup(char **secret)
+{
+  secret_free(*secret);
+}
+
+#define pf_autosecret __attribute__((cleanup (secret_cleanup)))
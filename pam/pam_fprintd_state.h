@@ -0,0 +1,203 @@
+/*
+ * pam_fprint: small state files kept under /run between authentications
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Everything lives in one root-owned directory. When the module runs
+ * unprivileged, e.g. in a screen locker, creating it fails and the
+ * callers simply go without their state. */
+#define STATE_DIR "/run/pam-fprintd-grosshack"
+#define STATE_PATH_MAX 256
+
+static inline int
+state_path(char *buf, size_t len, const char *subdir, const char *name)
+{
+  int r;
+
+  if (name)
+    r = snprintf(buf, len, "%s/%s/%s", STATE_DIR, subdir, name);
+  else
+    r = snprintf(buf, len, "%s/%s", STATE_DIR, subdir);
+  if (r < 0 || (size_t)r >= len)
+    return -ENAMETOOLONG;
+  return 0;
+}
+
+static inline int
+state_dir_ensure(const char *subdir)
+{
+  char path[STATE_PATH_MAX];
+  int r;
+
+  if (mkdir(STATE_DIR, 0700) < 0 && errno != EEXIST)
+    return -errno;
+
+  r = state_path(path, sizeof(path), subdir, NULL);
+  if (r < 0)
+    return r;
+  if (mkdir(path, 0700) < 0 && errno != EEXIST)
+    return -errno;
+
+  return 0;
+}
+
+/* Keys such as D-Bus object paths contain slashes, turn them into a
+ * single file name. */
+static inline void
+state_escape_key(char *buf, size_t len, const char *key)
+{
+  size_t i;
+
+  for (i = 0; key[i] != '\0' && i < len - 1; i++)
+    buf[i] = (key[i] == '/' || key[i] == '.') ? '_' : key[i];
+  buf[i] = '\0';
+}
+
+/* Reads a whole state file into buf, NUL-terminated. Files that are not
+ * owned by us, or that others can write, are ignored. Returns the length,
+ * with *ret_st filled in, or a negative errno. */
+static inline ssize_t
+state_file_read(const char *subdir, const char *name, char *buf, size_t len, struct stat *ret_st)
+{
+  char path[STATE_PATH_MAX];
+  struct stat st;
+  ssize_t n;
+  int fd;
+  int r;
+
+  r = state_path(path, sizeof(path), subdir, name);
+  if (r < 0)
+    return r;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0)
+    return errno > 0 ? -errno : -EIO;
+
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+      st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+  {
+    close(fd);
+    return -EPERM;
+  }
+
+  if (ret_st)
+    *ret_st = st;
+
+  n = read(fd, buf, len - 1);
+  r = -errno;
+  close(fd);
+  if (n < 0)
+    return r < 0 ? r : -EIO;
+
+  buf[n] = '\0';
+
+  return n;
+}
+
+/* Replaces a state file atomically, so that concurrent readers only
+ * ever see a complete file. */
+static inline int
+state_file_write(const char *subdir, const char *name, const char *buf, size_t len)
+{
+  char path[STATE_PATH_MAX];
+  char tmp_path[STATE_PATH_MAX + 16];
+  ssize_t n;
+  int fd;
+  int r;
+
+  r = state_dir_ensure(subdir);
+  if (r < 0)
+    return r;
+
+  r = state_path(path, sizeof(path), subdir, name);
+  if (r < 0)
+    return r;
+  r = snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path, (long)getpid());
+  if (r < 0 || (size_t)r >= sizeof(tmp_path))
+    return -ENAMETOOLONG;
+
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+  if (fd < 0)
+    return -errno;
+
+  n = write(fd, buf, len);
+  if (n < 0 || (size_t)n != len)
+  {
+    r = n < 0 ? -errno : -EIO;
+    close(fd);
+    unlink(tmp_path);
+    return r;
+  }
+  close(fd);
+
+  if (rename(tmp_path, path) < 0)
+  {
+    r = -errno;
+    unlink(tmp_path);
+    return r;
+  }
+
+  return 0;
+}
+
+/* Removes the files of subdir that were not rewritten for max_age
+ * seconds, such as the records of a reader that is gone for good. */
+static inline void
+state_dir_expire(const char *subdir, time_t max_age)
+{
+  char path[STATE_PATH_MAX];
+  struct dirent *entry;
+  struct stat st;
+  time_t wall_now = time(NULL);
+  DIR *dir;
+
+  if (state_path(path, sizeof(path), subdir, NULL) < 0)
+    return;
+  dir = opendir(path);
+  if (!dir)
+    return;
+
+  while ((entry = readdir(dir)))
+  {
+    if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+        !S_ISREG(st.st_mode) || st.st_uid != geteuid())
+      continue;
+    if (st.st_mtime + max_age < wall_now)
+      unlinkat(dirfd(dir), entry->d_name, 0);
+  }
+  closedir(dir);
+}
+
+static inline void
+state_file_remove(const char *subdir, const char *name)
+{
+  char path[STATE_PATH_MAX];
+
+  if (state_path(path, sizeof(path), subdir, name) == 0)
+    unlink(path);
+}
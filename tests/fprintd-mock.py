@@ -0,0 +1,255 @@
+#!/usr/bin/env python3
+#
+# fprintd-mock: a fake fprintd for benchmarking pam_fprintd_grosshack
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+"""Implements the part of the fprintd D-Bus API the module uses, on the
+system bus DBUS_SYSTEM_BUS_ADDRESS points at. Every method can be given a
+reply latency, and each VerifyStart replays a script of VerifyStatus
+signals. Prints "READY" on stdout once the name is owned."""
+
+import argparse
+import sys
+
+import dbus
+import dbus.mainloop.glib
+import dbus.service
+from gi.repository import GLib
+
+BUS_NAME = 'net.reactivated.Fprint'
+MANAGER_PATH = '/net/reactivated/Fprint/Manager'
+MANAGER_IFACE = 'net.reactivated.Fprint.Manager'
+DEVICE_PATH = '/net/reactivated/Fprint/Device/'
+DEVICE_IFACE = 'net.reactivated.Fprint.Device'
+ERROR_PREFIX = 'net.reactivated.Fprint.Error.'
+
+DONE_RESULTS = ('verify-match', 'verify-no-match', 'verify-unknown-error', 'verify-disconnected')
+
+
+class FprintError(dbus.DBusException):
+    def __init__(self, name, message=''):
+        super().__init__(message)
+        self._dbus_error_name = ERROR_PREFIX + name
+
+
+class Mock:
+    def __init__(self, args):
+        self.latency = {}
+        for spec in args.latency:
+            method, _, ms = spec.partition('=')
+            self.latency[method] = int(ms)
+        self.script = []
+        for step in filter(None, args.verify_script.split(',')):
+            result, _, ms = step.partition(':')
+            self.script.append((result, int(ms or 0)))
+        self.fingers = args.fingers
+
+    def reply(self, method, reply_cb, *values):
+        """Answers after the latency configured for the method, without
+        blocking the signals of other devices meanwhile"""
+        delay = self.latency.get(method, 0)
+        if delay == 0:
+            reply_cb(*values)
+            return
+
+        def later():
+            reply_cb(*values)
+            return GLib.SOURCE_REMOVE
+        GLib.timeout_add(delay, later)
+
+
+class Manager(dbus.service.Object):
+    def __init__(self, bus, mock, devices):
+        super().__init__(bus, MANAGER_PATH)
+        self.mock = mock
+        self.devices = devices
+
+    @dbus.service.method(MANAGER_IFACE, in_signature='', out_signature='ao',
+                         async_callbacks=('reply_cb', 'error_cb'))
+    def GetDevices(self, reply_cb, error_cb):
+        self.mock.reply('GetDevices', reply_cb,
+                        dbus.Array([d.path for d in self.devices], signature='o'))
+
+    @dbus.service.method(MANAGER_IFACE, in_signature='', out_signature='o',
+                         async_callbacks=('reply_cb', 'error_cb'))
+    def GetDefaultDevice(self, reply_cb, error_cb):
+        if not self.devices:
+            error_cb(FprintError('NoSuchDevice'))
+            return
+        self.mock.reply('GetDefaultDevice', reply_cb, dbus.ObjectPath(self.devices[0].path))
+
+
+class Device(dbus.service.Object):
+    def __init__(self, bus, mock, index, name, scan_type):
+        self.path = DEVICE_PATH + str(index)
+        super().__init__(bus, self.path)
+        self.mock = mock
+        self.props = {
+            'name': dbus.String(name),
+            'num-enroll-stages': dbus.Int32(5),
+            'scan-type': dbus.String(scan_type),
+            'finger-present': dbus.Boolean(False),
+            'finger-needed': dbus.Boolean(False),
+        }
+        self.claimer = None
+        self.verifying = False
+        self.pending = []
+
+    @dbus.service.method(dbus.PROPERTIES_IFACE, in_signature='ss', out_signature='v')
+    def Get(self, interface, prop):
+        if interface != DEVICE_IFACE or prop not in self.props:
+            raise dbus.DBusException('No such property', name='org.freedesktop.DBus.Error.InvalidArgs')
+        return self.props[prop]
+
+    @dbus.service.method(dbus.PROPERTIES_IFACE, in_signature='s', out_signature='a{sv}',
+                         async_callbacks=('reply_cb', 'error_cb'))
+    def GetAll(self, interface, reply_cb, error_cb):
+        props = self.props if interface == DEVICE_IFACE else {}
+        self.mock.reply('GetAll', reply_cb, dbus.Dictionary(props, signature='sv'))
+
+    @dbus.service.method(DEVICE_IFACE, in_signature='s', out_signature='as',
+                         async_callbacks=('reply_cb', 'error_cb'))
+    def ListEnrolledFingers(self, username, reply_cb, error_cb):
+        if not self.mock.fingers:
+            error_cb(FprintError('NoEnrolledPrints'))
+            return
+        self.mock.reply('ListEnrolledFingers', reply_cb,
+                        dbus.Array(self.mock.fingers, signature='s'))
+
+    @dbus.service.method(DEVICE_IFACE, in_signature='s', out_signature='',
+                         sender_keyword='sender', async_callbacks=('reply_cb', 'error_cb'))
+    def Claim(self, username, sender, reply_cb, error_cb):
+        if self.claimer is not None:
+            error_cb(FprintError('AlreadyInUse'))
+            return
+        self.claimer = sender
+        self.mock.reply('Claim', reply_cb)
+
+    @dbus.service.method(DEVICE_IFACE, in_signature='', out_signature='',
+                         async_callbacks=('reply_cb', 'error_cb'))
+    def Release(self, reply_cb, error_cb):
+        if self.claimer is None:
+            error_cb(FprintError('ClaimDevice'))
+            return
+        self.stop()
+        self.claimer = None
+        self.mock.reply('Release', reply_cb)
+
+    @dbus.service.method(DEVICE_IFACE, in_signature='s', out_signature='',
+                         async_callbacks=('reply_cb', 'error_cb'))
+    def VerifyStart(self, finger, reply_cb, error_cb):
+        if self.claimer is None:
+            error_cb(FprintError('ClaimDevice'))
+            return
+        if self.verifying:
+            error_cb(FprintError('AlreadyInUse'))
+            return
+        self.verifying = True
+
+        # The script starts counting once VerifyStart has been answered
+        def started(*args):
+            reply_cb()
+            self.VerifyFingerSelected(finger if finger != 'any' else self.mock.fingers[0])
+            self.play()
+        self.mock.reply('VerifyStart', started)
+
+    @dbus.service.method(DEVICE_IFACE, in_signature='', out_signature='',
+                         async_callbacks=('reply_cb', 'error_cb'))
+    def VerifyStop(self, reply_cb, error_cb):
+        if not self.verifying:
+            error_cb(FprintError('NoActionInProgress'))
+            return
+        self.stop()
+        self.mock.reply('VerifyStop', reply_cb)
+
+    @dbus.service.signal(DEVICE_IFACE, signature='sb')
+    def VerifyStatus(self, result, done):
+        pass
+
+    @dbus.service.signal(DEVICE_IFACE, signature='s')
+    def VerifyFingerSelected(self, finger):
+        pass
+
+    def play(self):
+        elapsed = 0
+        for result, delay in self.mock.script:
+            elapsed += delay
+            done = result in DONE_RESULTS
+            self.pending.append(GLib.timeout_add(elapsed, self.emit, result, done))
+            if done:
+                break
+
+    def emit(self, result, done):
+        if self.verifying:
+            self.VerifyStatus(result, done)
+            if done:
+                self.verifying = False
+                self.pending = []
+        return GLib.SOURCE_REMOVE
+
+    def stop(self):
+        for source in self.pending:
+            GLib.source_remove(source)
+        self.pending = []
+        self.verifying = False
+
+    def name_lost(self, name):
+        if name == self.claimer:
+            self.stop()
+            self.claimer = None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--device', action='append', default=[],
+                        help='Name of a reader, repeat for more; one by default')
+    parser.add_argument('--scan-type', default='press', choices=('press', 'swipe'))
+    parser.add_argument('--fingers', nargs='*', default=['right-index-finger'],
+                        help='Fingers enrolled for any user, none for no prints')
+    parser.add_argument('--latency', action='append', default=[], metavar='METHOD=MS',
+                        help='Delay the replies to a method, e.g. Claim=50')
+    parser.add_argument('--verify-script', default='verify-match:300', metavar='RESULT:MS,...',
+                        help='VerifyStatus signals sent after each VerifyStart, each MS after '
+                             'the previous one; empty for a reader that never answers')
+    args = parser.parse_args()
+
+    dbus.mainloop.glib.DBusGMainLoop(set_as_default=True)
+    bus = dbus.SystemBus()
+    mock = Mock(args)
+
+    devices = [Device(bus, mock, i, name, args.scan_type)
+               for i, name in enumerate(args.device or ['Bench Reader'])]
+    manager = Manager(bus, mock, devices)
+
+    def name_owner_changed(name, old_owner, new_owner):
+        if not new_owner:
+            for device in devices:
+                device.name_lost(name)
+    bus.add_signal_receiver(name_owner_changed, 'NameOwnerChanged',
+                            dbus.BUS_DAEMON_IFACE, dbus.BUS_DAEMON_NAME, dbus.BUS_DAEMON_PATH)
+
+    name = dbus.service.BusName(BUS_NAME, bus, do_not_queue=True)
+    print('READY', flush=True)
+
+    try:
+        GLib.MainLoop().run()
+    except KeyboardInterrupt:
+        pass
+    del name, manager
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,209 @@
+#!/usr/bin/env python3
+#
+# pam-bench: time pam_fprintd_grosshack against a mock fprintd
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+"""Runs authentications through pam_wrapper against fprintd-mock.py on a
+private system bus and reports p50/p99 time-to-prompt, time-to-result and
+CPU time. Arguments after "--" are passed to the mock, e.g.
+"-- --latency Claim=50 --verify-script verify-no-match:400,verify-match:300"."""
+
+import argparse
+import ctypes
+import getpass
+import os
+import resource
+import select
+import subprocess
+import sys
+import tempfile
+import time
+
+import dbusmock
+
+PAM_PROMPT_ECHO_OFF = 1
+PAM_PROMPT_ECHO_ON = 2
+PAM_SUCCESS = 0
+PAM_BUF_ERR = 5
+PAM_CONV_ERR = 19
+
+ABORT_FD_ENV = 'PAM_FPRINTD_GROSSHACK_ABORT_FD'
+SERVICE = 'pam-bench'
+MOCK = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'fprintd-mock.py')
+
+
+class PamMessage(ctypes.Structure):
+    _fields_ = [('msg_style', ctypes.c_int), ('msg', ctypes.c_char_p)]
+
+
+class PamResponse(ctypes.Structure):
+    _fields_ = [('resp', ctypes.c_void_p), ('resp_retcode', ctypes.c_int)]
+
+
+CONV_FUNC = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_int,
+                             ctypes.POINTER(ctypes.POINTER(PamMessage)),
+                             ctypes.POINTER(ctypes.POINTER(PamResponse)),
+                             ctypes.c_void_p)
+
+
+class PamConv(ctypes.Structure):
+    _fields_ = [('conv', CONV_FUNC), ('appdata_ptr', ctypes.c_void_p)]
+
+
+# Through the global namespace, so that pam_wrapper's LD_PRELOADed
+# pam_start() is the one called
+libc = ctypes.CDLL(None)
+libc.calloc.restype = ctypes.c_void_p
+libc.calloc.argtypes = [ctypes.c_size_t, ctypes.c_size_t]
+libc.strdup.restype = ctypes.c_void_p
+libc.strdup.argtypes = [ctypes.c_char_p]
+libc.pam_start.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.POINTER(PamConv),
+                           ctypes.POINTER(ctypes.c_void_p)]
+libc.pam_putenv.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+libc.pam_authenticate.argtypes = [ctypes.c_void_p, ctypes.c_int]
+libc.pam_end.argtypes = [ctypes.c_void_p, ctypes.c_int]
+
+
+class Run:
+    """One authentication. The password prompt is answered once the
+    module signals the abort fd, or after password_after seconds with
+    the configured password."""
+
+    def __init__(self, args):
+        self.args = args
+        self.prompted = None
+        self.abort_fd = os.eventfd(0, os.EFD_CLOEXEC)
+        self.conv = PamConv(CONV_FUNC(self.conversation), None)
+
+    def conversation(self, num_msg, msgs, ret_resp, appdata):
+        if self.prompted is None:
+            self.prompted = time.monotonic()
+
+        resp = libc.calloc(num_msg, ctypes.sizeof(PamResponse))
+        if not resp:
+            return PAM_BUF_ERR
+        responses = ctypes.cast(resp, ctypes.POINTER(PamResponse))
+
+        for i in range(num_msg):
+            if msgs[i].contents.msg_style not in (PAM_PROMPT_ECHO_OFF, PAM_PROMPT_ECHO_ON):
+                continue
+            ready, _, _ = select.select([self.abort_fd], [], [], self.args.password_after)
+            if ready:
+                os.eventfd_read(self.abort_fd)
+                libc.free(ctypes.c_void_p(resp))
+                return PAM_CONV_ERR
+            responses[i].resp = libc.strdup(self.args.password.encode())
+
+        ret_resp[0] = responses
+        return PAM_SUCCESS
+
+    def authenticate(self, user):
+        pamh = ctypes.c_void_p()
+        r = libc.pam_start(SERVICE.encode(), user.encode(), ctypes.byref(self.conv), ctypes.byref(pamh))
+        if r != PAM_SUCCESS:
+            raise RuntimeError('pam_start failed: {}'.format(r))
+        libc.pam_putenv(pamh, '{}={}'.format(ABORT_FD_ENV, self.abort_fd).encode())
+
+        cpu = resource.getrusage(resource.RUSAGE_SELF)
+        started = time.monotonic()
+        r = libc.pam_authenticate(pamh, 0)
+        finished = time.monotonic()
+        cpu_end = resource.getrusage(resource.RUSAGE_SELF)
+
+        libc.pam_end(pamh, r)
+        os.close(self.abort_fd)
+
+        return {
+            'result': r,
+            'prompt': (self.prompted - started) if self.prompted else None,
+            'total': finished - started,
+            'cpu': (cpu_end.ru_utime + cpu_end.ru_stime) - (cpu.ru_utime + cpu.ru_stime),
+        }
+
+
+def percentile(values, p):
+    """Nearest rank"""
+    values = sorted(values)
+    rank = max(1, -(-len(values) * p // 100))
+    return values[int(rank) - 1]
+
+
+def report(samples):
+    results = {}
+    for s in samples:
+        results[s['result']] = results.get(s['result'], 0) + 1
+    print('runs: {}, PAM results: {}'.format(
+        len(samples), ', '.join('{}: {}'.format(k, v) for k, v in sorted(results.items()))))
+
+    for key, label in (('prompt', 'time-to-prompt'), ('total', 'time-to-result'), ('cpu', 'CPU time')):
+        values = [s[key] for s in samples if s[key] is not None]
+        if not values:
+            print('{:>15}: none'.format(label))
+            continue
+        print('{:>15}: p50 {:8.2f} ms  p99 {:8.2f} ms  mean {:8.2f} ms'.format(
+            label, percentile(values, 50) * 1000, percentile(values, 99) * 1000,
+            sum(values) / len(values) * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--module', required=True, help='Path to pam_fprintd_grosshack.so')
+    parser.add_argument('--module-args', default='', help='Options for the module, e.g. "no-pthread"')
+    parser.add_argument('--runs', type=int, default=20)
+    parser.add_argument('--warmup', type=int, default=1, help='Runs left out of the report')
+    parser.add_argument('--password-after', type=float, default=10.0, metavar='SECS',
+                        help='Answer a password prompt the module did not end by then')
+    parser.add_argument('--password', default='')
+    parser.add_argument('mock_args', nargs=argparse.REMAINDER)
+    args = parser.parse_args()
+    mock_args = args.mock_args[1:] if args.mock_args[:1] == ['--'] else args.mock_args
+
+    # pam_wrapper reads its configuration when it is loaded
+    if 'PAM_WRAPPER_SERVICE_DIR' not in os.environ:
+        service_dir = tempfile.mkdtemp(prefix='pam-bench-')
+        with open(os.path.join(service_dir, SERVICE), 'w') as f:
+            f.write('auth required {} {}\n'.format(os.path.abspath(args.module), args.module_args))
+        env = dict(os.environ,
+                   PAM_WRAPPER='1',
+                   PAM_WRAPPER_SERVICE_DIR=service_dir,
+                   LD_PRELOAD=os.environ.get('PAM_WRAPPER_LIB', 'libpam_wrapper.so'))
+        os.execve(sys.executable, [sys.executable] + sys.argv, env)
+
+    # In "no-pthread" mode the module reads key presses from the terminal
+    devnull = os.open(os.devnull, os.O_RDONLY)
+    os.dup2(devnull, 0)
+    os.close(devnull)
+
+    dbusmock.DBusTestCase.start_system_bus()
+    mock = subprocess.Popen([sys.executable, MOCK] + mock_args, stdout=subprocess.PIPE, text=True)
+    try:
+        if mock.stdout.readline().strip() != 'READY':
+            print('fprintd-mock failed to start', file=sys.stderr)
+            return 1
+
+        user = getpass.getuser()
+        samples = [Run(args).authenticate(user) for _ in range(args.warmup + args.runs)]
+        report(samples[args.warmup:])
+    finally:
+        mock.terminate()
+        mock.wait()
+        dbusmock.DBusTestCase.stop_dbus(dbusmock.DBusTestCase.system_bus_pid)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())